@@ -0,0 +1,263 @@
+// Throughput of the SLIP encoders and the buffered decoder over synthetic
+// corpora, with each scan kernel this CPU supports. Optionally also over the
+// packets in a pcap file, e.g. one written with -w.
+//
+// Usage: bench/codec [capture.pcap]
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../codec.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC
+#endif
+
+#define CORPUS_PACKETS 4096
+#define MAX_PACKET 1500
+#define ROUNDS 20
+
+typedef struct corpus {
+    const char *name;
+    int count;
+    int lengths[CORPUS_PACKETS];
+    unsigned char *packets[CORPUS_PACKETS];
+    size_t bytes;
+} corpus;
+
+static unsigned char plain_byte(void) {
+    unsigned char c;
+    do {
+        c = rand();
+    } while (c == END || c == ESC);
+    return c;
+}
+
+static void add_packet(corpus *c, const unsigned char *data, int length) {
+    if (c->count == CORPUS_PACKETS) {
+        return;
+    }
+    c->packets[c->count] = malloc(length);
+    memcpy(c->packets[c->count], data, length);
+    c->lengths[c->count] = length;
+    c->bytes += length;
+    c->count++;
+}
+
+// Full size packets where one byte in every 1/escape_rate needs escaping
+static void make_random(corpus *c, const char *name, double escape_rate) {
+    unsigned char packet[MAX_PACKET];
+    c->name = name;
+    for (int i = 0; i < CORPUS_PACKETS; i++) {
+        for (int j = 0; j < MAX_PACKET; j++) {
+            if (escape_rate >= 1 || rand() < escape_rate * RAND_MAX) {
+                packet[j] = (rand() & 1) ? END : ESC;
+            } else {
+                packet[j] = plain_byte();
+            }
+        }
+        add_packet(c, packet, MAX_PACKET);
+    }
+}
+
+// Roughly what an interactive session plus a download looks like: 40 byte
+// ACKs, small text segments and full size segments of compressed data, all
+// with TCP/IP headers
+static void make_tcp(corpus *c) {
+    unsigned char packet[MAX_PACKET];
+    c->name = "tcp mix";
+    for (int i = 0; i < CORPUS_PACKETS; i++) {
+        int kind = i % 4;
+        int length = kind == 0 ? 40 : kind == 1 ? 40 + 1 + rand() % 80
+                                                : MAX_PACKET;
+
+        memset(packet, 0, 40);
+        packet[0] = 0x45;
+        packet[2] = length >> 8;
+        packet[3] = length;
+        packet[4] = i >> 8;
+        packet[5] = i;
+        packet[8] = 64;
+        packet[9] = 6;
+        memcpy(&packet[12], (unsigned char[]){192, 168, 190, 1, 192, 168, 190,
+                                              2},
+               8);
+        for (int j = 10; j < 40; j++) {
+            if (j == 10 || j == 11 || (j >= 24 && j < 32) || j == 36 ||
+                j == 37) {
+                packet[j] = rand(); // checksums, sequence numbers
+            }
+        }
+        packet[32] = 0x50;
+        packet[33] = 0x10;
+        for (int j = 40; j < length; j++) {
+            packet[j] = kind == 1 ? ' ' + rand() % 95 : rand();
+        }
+        add_packet(c, packet, length);
+    }
+}
+
+static int load_pcap(corpus *c, const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    uint32_t header[6];
+    if (fread(header, sizeof(header), 1, file) != 1 ||
+        header[0] != 0xa1b2c3d4) {
+        fprintf(stderr, "%s: not a native byte order pcap file\n", path);
+        fclose(file);
+        return -1;
+    }
+
+    c->name = path;
+    uint32_t record[4];
+    unsigned char packet[65536];
+    while (fread(record, sizeof(record), 1, file) == 1 &&
+           record[2] <= sizeof(packet) &&
+           fread(packet, record[2], 1, file) == 1) {
+        add_packet(c, packet, record[2]);
+    }
+    fclose(file);
+    return c->count > 0 ? 0 : -1;
+}
+
+static double seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static uint64_t cycles(void) {
+#ifdef HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static void report(const char *what, size_t bytes, double elapsed,
+                   uint64_t cycle_count) {
+    printf("  %-8s %8.1f MB/s", what, bytes / elapsed / 1e6);
+#ifdef HAVE_TSC
+    printf("  %6.2f cycles/byte", (double)cycle_count / bytes);
+#else
+    printf("  %6.3f ns/byte", elapsed * 1e9 / bytes);
+#endif
+    printf("\n");
+}
+
+static volatile size_t sink;
+
+static void bench(corpus *c, unsigned char *encoded, size_t *encoded_length) {
+    size_t total = 0;
+
+    // encode_slip()
+    double start = seconds();
+    uint64_t start_cycles = cycles();
+    for (int r = 0; r < ROUNDS; r++) {
+        size_t used = 0;
+        for (int i = 0; i < c->count; i++) {
+            used += encode_slip(c->packets[i], &encoded[used], c->lengths[i]);
+        }
+        total = used;
+    }
+    report("encode", c->bytes * ROUNDS, seconds() - start,
+           cycles() - start_cycles);
+    *encoded_length = total;
+
+    // encode_slip_iov(), falling back to encode_slip() like write_packet()
+    struct iovec iov[SLIP_MAX_IOV];
+    unsigned char fallback[2 * MAX_PACKET + 1];
+    int fallbacks = 0;
+    start = seconds();
+    start_cycles = cycles();
+    for (int r = 0; r < ROUNDS; r++) {
+        for (int i = 0; i < c->count; i++) {
+            int n = encode_slip_iov(c->packets[i], c->lengths[i], iov,
+                                    SLIP_MAX_IOV);
+            if (n == -1) {
+                sink += encode_slip(c->packets[i], fallback, c->lengths[i]);
+                fallbacks++;
+            } else {
+                sink += n;
+            }
+        }
+    }
+    report("iov", c->bytes * ROUNDS, seconds() - start,
+           cycles() - start_cycles);
+    printf("           %.1f%% of packets fell back to copying\n",
+           100.0 * fallbacks / (c->count * ROUNDS));
+
+    // slip_decode_buffered(), fed a read buffer at a time
+    static slip_reader reader;
+    unsigned char packet[65536];
+    start = seconds();
+    start_cycles = cycles();
+    for (int r = 0; r < ROUNDS; r++) {
+        slip_reader_init(&reader, -1);
+        for (size_t pos = 0; pos < total; pos += reader.len) {
+            reader.len = total - pos < sizeof(reader.buf) ? total - pos
+                                                          : sizeof(reader.buf);
+            reader.pos = 0;
+            memcpy(reader.buf, &encoded[pos], reader.len);
+            int length;
+            while ((length = slip_decode_buffered(&reader, packet,
+                                                  sizeof(packet))) !=
+                   SLIP_NEED_MORE) {
+                sink += length;
+            }
+        }
+    }
+    report("decode", c->bytes * ROUNDS, seconds() - start,
+           cycles() - start_cycles);
+}
+
+int main(int argc, char **argv) {
+    static corpus corpora[5];
+    int count = 0;
+
+    srand(1);
+    make_random(&corpora[count++], "no escapes", 0);
+    make_random(&corpora[count++], "1% escapes", 0.01);
+    make_random(&corpora[count++], "all END", 1);
+    make_tcp(&corpora[count++]);
+    if (argc > 1) {
+        if (load_pcap(&corpora[count], argv[1]) == -1) {
+            return 1;
+        }
+        count++;
+    }
+
+    size_t largest = 0;
+    for (int i = 0; i < count; i++) {
+        largest = corpora[i].bytes > largest ? corpora[i].bytes : largest;
+    }
+    unsigned char *encoded = malloc(2 * largest + CORPUS_PACKETS);
+    if (encoded == NULL) {
+        perror("malloc");
+        return 1;
+    }
+
+    const char *kernels[] = {"scalar", "sse2", "avx2", "neon"};
+    for (int k = 0; k < 4; k++) {
+        if (slip_select_kernel(kernels[k]) == -1) {
+            continue;
+        }
+        for (int i = 0; i < count; i++) {
+            size_t encoded_length;
+            printf("%s, %s (%d packets, %zu bytes):\n", kernels[k],
+                   corpora[i].name, corpora[i].count, corpora[i].bytes);
+            bench(&corpora[i], encoded, &encoded_length);
+            printf("           %.3f wire bytes per byte\n",
+                   (double)encoded_length / corpora[i].bytes);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,35 @@
+#!/bin/sh
+# End-to-end benchmark. Runs ./slip in socket server mode with bench/peer as
+# the remote end, which echoes everything back, then pings through the utun
+# to measure round trip time and packets per second.
+#
+# Must be run as root from the top of the tree after make bench. Any
+# arguments are passed on to ./slip, e.g. sudo bench/e2e.sh -B 4096 -Q priority
+
+SOCKET=/tmp/slip-bench.sock
+STATS=/tmp/slip-bench.stats
+LOCAL=10.254.0.1
+REMOTE=10.254.0.2
+
+./slip -t s -l $LOCAL -r $REMOTE -s $STATS "$@" $SOCKET > /tmp/slip-bench.log &
+SLIP=$!
+trap 'kill $PEER $SLIP 2> /dev/null' EXIT
+sleep 1
+bench/peer $SOCKET &
+PEER=$!
+sleep 1
+
+echo "Round trip, 500 x 56 byte pings:"
+ping -q -c 500 -i 0.01 $REMOTE | tail -1
+
+for size in 56 512 1400; do
+    echo "Flood, 10000 x $size byte pings:"
+    /usr/bin/time -p ping -q -f -c 10000 -s $size $REMOTE \
+        > /tmp/slip-bench.ping 2> /tmp/slip-bench.time
+    tail -2 /tmp/slip-bench.ping
+    awk '/^real/ { printf "%.0f packets/s each way\n", 10000 / $2 }' \
+        /tmp/slip-bench.time
+done
+
+echo "Counters:"
+nc -U $STATS
@@ -0,0 +1,104 @@
+// Stand-in for the remote device in end-to-end benchmarks. Connects to the
+// Unix domain socket of an instance running with -t s and sends every ICMP
+// echo request and UDP datagram straight back, so anything pinged through
+// the utun measures the whole path without a second machine.
+//
+// Usage: bench/peer socket_path
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../codec.h"
+
+static unsigned long echoed, ignored;
+
+static void done(int sig) {
+    (void)sig;
+    printf("%lu packets echoed, %lu ignored\n", echoed, ignored);
+    exit(0);
+}
+
+static void swap(unsigned char *a, unsigned char *b, int length) {
+    unsigned char tmp[4];
+    memcpy(tmp, a, length);
+    memcpy(a, b, length);
+    memcpy(b, tmp, length);
+}
+
+// Turns the packet round in place. Swapping addresses or ports doesn't
+// change any checksum. Returns 0 if it isn't something we echo.
+static int reflect(unsigned char *ip, int length) {
+    if (length < 20 || (ip[0] >> 4) != 4) {
+        return 0;
+    }
+    int header_length = (ip[0] & 0x0f) * 4;
+    if (length < header_length + 8) {
+        return 0;
+    }
+    unsigned char *l4 = &ip[header_length];
+
+    if (ip[9] == 1 && l4[0] == 8) {
+        // Echo request to reply, which changes the ICMP checksum by the
+        // difference in the type byte
+        l4[0] = 0;
+        unsigned int sum = (l4[2] << 8 | l4[3]) + 0x0800;
+        sum = (sum & 0xffff) + (sum >> 16);
+        l4[2] = sum >> 8;
+        l4[3] = sum;
+    } else if (ip[9] == 17) {
+        swap(&l4[0], &l4[2], 2);
+    } else {
+        return 0;
+    }
+
+    swap(&ip[12], &ip[16], 4);
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s socket_path\n", argv[0]);
+        return 1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path) - 1);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    signal(SIGINT, done);
+    signal(SIGTERM, done);
+
+    static slip_reader reader;
+    slip_reader_init(&reader, fd);
+    slip_select_kernel(NULL);
+
+    unsigned char packet[65536];
+    unsigned char encoded[2 * sizeof(packet) + 1];
+    while (1) {
+        int length = next_slip_packet_buffered(&reader, packet, sizeof(packet));
+        if (length < 0 && length != SLIP_PACKET_TOO_LONG) {
+            done(0);
+        } else if (length <= 0 || !reflect(packet, length)) {
+            ignored++;
+            continue;
+        }
+
+        int n = encode_slip(packet, encoded, length);
+        if (write(fd, encoded, n) != n) {
+            perror("write");
+            done(0);
+        }
+        echoed++;
+    }
+}
@@ -0,0 +1,232 @@
+#include "bond.h"
+
+#include <time.h>
+
+#include "slip.h"
+
+// A byte on the line is 10 bits with the start and stop bits
+#define BITS_PER_BYTE 10
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+static uint64_t line_time_ns(slip_link *member, int bytes) {
+    return (uint64_t)bytes * BITS_PER_BYTE * NSEC_PER_SEC / member->baud;
+}
+
+void bond_init(bond *bond, slip_link *link, slip_link *members, int count,
+               size_t queue_depth, int timeout_ms) {
+    bond->link = link;
+    bond->members = members;
+    bond->count = count;
+    bond->pool = link->pool;
+    bond->queue_depth = queue_depth;
+
+    uint64_t slowest = 0;
+    for (int i = 0; i < count; i++) {
+        packet_queue_init(&bond->queues[i], queue_depth);
+        bond->busy_until[i] = 0;
+        atomic_init(&bond->up[i], 0);
+        uint64_t frames = line_time_ns(&members[i],
+                                       2 * MAX_PACKET_SIZE_SLIP(link->mtu));
+        slowest = frames > slowest ? frames : slowest;
+    }
+    bond->tx_seq = 0;
+
+    pthread_mutex_init(&bond->lock, NULL);
+    pthread_cond_init(&bond->changed, NULL);
+    bond->timeout_ns = (uint64_t)timeout_ms * NSEC_PER_MSEC;
+    if (timeout_ms <= 0) {
+        // Frames sent at the same time on a fast and a slow line can arrive
+        // a whole frame apart without anything being lost
+        bond->timeout_ns = DEFAULT_BOND_TIMEOUT_MS * NSEC_PER_MSEC;
+        if (slowest > bond->timeout_ns) {
+            bond->timeout_ns = slowest;
+        }
+    }
+    bond->synced = 0;
+    bond->skipped = 0;
+    bond->late_run = 0;
+    bond->next_seq = 0;
+    bond->buffered = 0;
+    for (int i = 0; i < BOND_REORDER_WINDOW; i++) {
+        bond->slots[i] = PACKET_NONE;
+    }
+    atomic_init(&bond->late, 0);
+    atomic_init(&bond->lost, 0);
+    atomic_init(&bond->resyncs, 0);
+    atomic_init(&bond->queue_dropped, 0);
+}
+
+int bond_send(bond *bond, packet_handle h) {
+    packet *p = packet_get(bond->pool, h);
+    uint64_t now = now_ns();
+
+    // Earliest finish: the member that would have this frame on the wire
+    // soonest, counting what it hasn't sent yet. Escapes aren't known until
+    // it is encoded, so only the END is added.
+    int best = -1;
+    int any_up = 0;
+    uint64_t best_finish = 0;
+    for (int i = 0; i < bond->count; i++) {
+        if (!atomic_load_explicit(&bond->up[i], memory_order_relaxed)) {
+            continue;
+        }
+        any_up = 1;
+        if (packet_queue_length(&bond->queues[i]) >= bond->queue_depth) {
+            continue;
+        }
+        uint64_t start =
+            bond->busy_until[i] > now ? bond->busy_until[i] : now;
+        uint64_t finish =
+            start + line_time_ns(&bond->members[i],
+                                 p->length + BOND_HEADER_SIZE + 1);
+        if (best == -1 || finish < best_finish) {
+            best = i;
+            best_finish = finish;
+        }
+    }
+    if (best == -1) {
+        if (any_up) {
+            atomic_fetch_add_explicit(&bond->queue_dropped, 1,
+                                      memory_order_relaxed);
+        } else {
+            STAT_ADD(bond->link->stats.tx_outage_dropped, 1);
+        }
+        return -1;
+    }
+
+    p->offset -= BOND_HEADER_SIZE;
+    p->length += BOND_HEADER_SIZE;
+    unsigned char *header = &p->data[p->offset];
+    header[0] = bond->tx_seq >> 8;
+    header[1] = bond->tx_seq & 0xff;
+
+    if (packet_queue_push(&bond->queues[best], h) == -1) {
+        atomic_fetch_add_explicit(&bond->queue_dropped, 1,
+                                  memory_order_relaxed);
+        p->offset += BOND_HEADER_SIZE;
+        p->length -= BOND_HEADER_SIZE;
+        return -1;
+    }
+    // Only frames actually sent use up a number, so the far end doesn't
+    // wait for ones that were never going to come
+    bond->busy_until[best] = best_finish;
+    bond->tx_seq++;
+    return 0;
+}
+
+packet_queue *bond_member_queue(bond *bond, slip_link *member) {
+    return &bond->queues[member - bond->members];
+}
+
+void bond_member_up(bond *bond, slip_link *member, int up) {
+    atomic_store_explicit(&bond->up[member - bond->members], up,
+                          memory_order_relaxed);
+}
+
+// Called with the lock held
+static void flush_reorder(bond *bond) {
+    for (int i = 0; i < BOND_REORDER_WINDOW; i++) {
+        if (bond->slots[i] != PACKET_NONE) {
+            packet_free(bond->pool, bond->slots[i]);
+            bond->slots[i] = PACKET_NONE;
+        }
+    }
+    bond->buffered = 0;
+}
+
+int bond_receive(bond *bond, packet_handle h, unsigned char *frame,
+                 int length) {
+    if (length <= BOND_HEADER_SIZE) {
+        return -1;
+    }
+    uint16_t seq = frame[0] << 8 | frame[1];
+
+    packet *p = packet_get(bond->pool, h);
+    p->offset = frame + BOND_HEADER_SIZE - p->data;
+    p->length = length - BOND_HEADER_SIZE;
+
+    pthread_mutex_lock(&bond->lock);
+    if (!bond->synced) {
+        bond->next_seq = seq;
+        bond->synced = 1;
+    }
+
+    int16_t ahead = (int16_t)(seq - bond->next_seq);
+    int slot = seq % BOND_REORDER_WINDOW;
+    int behind = ahead < 0 && ahead >= -BOND_REORDER_WINDOW;
+    if (behind && bond->late_run < BOND_LATE_RESYNC - 1) {
+        bond->late_run++;
+        pthread_mutex_unlock(&bond->lock);
+        atomic_fetch_add_explicit(&bond->late, 1, memory_order_relaxed);
+        return -1;
+    } else if (ahead >= 0 && ahead < BOND_REORDER_WINDOW &&
+               bond->slots[slot] != PACKET_NONE) {
+        // A duplicate
+        pthread_mutex_unlock(&bond->lock);
+        atomic_fetch_add_explicit(&bond->late, 1, memory_order_relaxed);
+        return -1;
+    } else if (ahead < 0 || ahead >= BOND_REORDER_WINDOW) {
+        // Outside the window, or behind it for too long. Whatever we were
+        // waiting for isn't coming.
+        flush_reorder(bond);
+        bond->next_seq = seq;
+        bond->skipped = 1;
+        atomic_fetch_add_explicit(&bond->resyncs, 1, memory_order_relaxed);
+    }
+
+    bond->late_run = 0;
+    bond->slots[slot] = h;
+    bond->arrived[slot] = now_ns();
+    bond->buffered++;
+    pthread_cond_signal(&bond->changed);
+    pthread_mutex_unlock(&bond->lock);
+    return 0;
+}
+
+packet_handle bond_next(bond *bond, int *lost) {
+    pthread_mutex_lock(&bond->lock);
+
+    while (1) {
+        int slot = bond->next_seq % BOND_REORDER_WINDOW;
+        if (bond->slots[slot] != PACKET_NONE) {
+            packet_handle h = bond->slots[slot];
+            bond->slots[slot] = PACKET_NONE;
+            bond->buffered--;
+            bond->next_seq++;
+            *lost = bond->skipped;
+            bond->skipped = 0;
+            pthread_mutex_unlock(&bond->lock);
+            return h;
+        } else if (bond->buffered == 0) {
+            pthread_cond_wait(&bond->changed, &bond->lock);
+            continue;
+        }
+
+        // Something later is here already. The one we want gets until the
+        // timeout after the oldest of those arrived, then it is skipped.
+        uint64_t oldest = UINT64_MAX;
+        for (int i = 0; i < BOND_REORDER_WINDOW; i++) {
+            if (bond->slots[i] != PACKET_NONE && bond->arrived[i] < oldest) {
+                oldest = bond->arrived[i];
+            }
+        }
+        uint64_t deadline = oldest + bond->timeout_ns;
+        uint64_t now = now_ns();
+        if (now >= deadline) {
+            bond->next_seq++;
+            bond->skipped = 1;
+            atomic_fetch_add_explicit(&bond->lost, 1, memory_order_relaxed);
+            continue;
+        }
+
+        struct timespec wait = {(deadline - now) / NSEC_PER_SEC,
+                                (deadline - now) % NSEC_PER_SEC};
+        pthread_cond_timedwait_relative_np(&bond->changed, &bond->lock,
+                                           &wait);
+    }
+}
@@ -0,0 +1,96 @@
+#ifndef BOND_H
+#define BOND_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "pool.h"
+#include "queue.h"
+
+// Bonding stripes the packets of one utun across several devices, e.g. the
+// spare UARTs of a board, for more bandwidth than one line has. After the
+// stages every frame gets a 16 bit sequence number in front of it, and each
+// goes to whichever device should have finished sending by the earliest time,
+// going by its baud rate and what it already has queued. The far end, which
+// must be bonding too, puts frames back in order before its stages see them.
+// A missing frame is given up on once a later one has waited a timeout.
+
+#define BOND_MAX_MEMBERS 8
+#define BOND_HEADER_SIZE 2
+
+// Frames further ahead than this of the one we are waiting for mean the far
+// end has restarted or too much has been lost, and we start again from them
+#define BOND_REORDER_WINDOW 64
+
+// So do this many frames in a row from behind it, e.g. because the far end
+// restarted with a sequence number just short of ours. One or two are just
+// stragglers from a slow device.
+#define BOND_LATE_RESYNC 8
+
+// At least this long, or long enough for two full frames on the slowest
+// device
+#define DEFAULT_BOND_TIMEOUT_MS 50
+
+struct slip_link;
+
+typedef struct bond {
+    struct slip_link *link;    // the utun side, which runs the stages
+    struct slip_link *members; // one for each device
+    int count;
+    packet_pool *pool;
+    size_t queue_depth;
+
+    // TX, only touched by the link's writer. Each member has a queue of
+    // frames for its own writer.
+    packet_queue queues[BOND_MAX_MEMBERS];
+    uint64_t busy_until[BOND_MAX_MEMBERS]; // ns, when it should be idle
+    atomic_int up[BOND_MAX_MEMBERS];       // device connected
+    uint16_t tx_seq;
+    atomic_ulong queue_dropped; // every member that is up had a full queue
+
+    // RX reorder buffer, filled by every member's reader and emptied in
+    // order by one thread
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    uint64_t timeout_ns;
+    int synced; // next_seq is known
+    int skipped; // frames were lost since the last bond_next()
+    int late_run; // frames in a row from behind next_seq
+    uint16_t next_seq;
+    int buffered;
+    packet_handle slots[BOND_REORDER_WINDOW];
+    uint64_t arrived[BOND_REORDER_WINDOW]; // ns
+
+    atomic_ulong late;    // arrived after being given up on, or twice
+    atomic_ulong lost;    // given up on
+    atomic_ulong resyncs; // started again from a frame outside the window
+} bond;
+
+// members must already be set up, with the baud rates to weigh them by
+void bond_init(bond *bond, struct slip_link *link, struct slip_link *members,
+               int count, size_t queue_depth, int timeout_ms);
+
+// Puts the sequence number in front of the frame in packet h, which must
+// have room for it, and queues it for one of the members. Returns -1 if none
+// of them can take it, in which case the packet still belongs to the caller.
+// The drop is counted, as outage_dropped if no member is up, otherwise in
+// queue_dropped.
+int bond_send(bond *bond, packet_handle h);
+
+// The queue member's writer takes its frames from
+packet_queue *bond_member_queue(bond *bond, struct slip_link *member);
+void bond_member_up(bond *bond, struct slip_link *member, int up);
+
+// Takes packet h, holding a frame of length bytes at frame, into the reorder
+// buffer. Returns -1 if it isn't wanted, in which case it still belongs to
+// the caller.
+int bond_receive(bond *bond, packet_handle h, unsigned char *frame,
+                 int length);
+
+// Waits for the next frame in order and returns its packet, with the
+// sequence number removed. *lost is set if frames were given up on since the
+// last call, so compression state can be reset.
+packet_handle bond_next(bond *bond, int *lost);
+
+#endif
@@ -0,0 +1,186 @@
+#include "capture.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/event.h>
+
+typedef struct pcap_header {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+} pcap_header;
+
+typedef struct pcap_record_header {
+    uint32_t ts_sec;
+    uint32_t ts_usec;
+    uint32_t incl_len;
+    uint32_t orig_len;
+} pcap_record_header;
+
+void capture_packet(packet_capture *capture, int direction,
+                    const unsigned char *ip, int length) {
+    if (!atomic_load_explicit(&capture->enabled, memory_order_relaxed)) {
+        return;
+    }
+
+    capture_ring *ring = &capture->rings[direction];
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if ((tail + 1) % CAPTURE_RING_SLOTS == head) {
+        atomic_fetch_add_explicit(&capture->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    capture_record *record =
+        (capture_record *)&ring->slots[tail * capture->slot_size];
+    gettimeofday(&record->time, NULL);
+    record->length = length;
+    memcpy(record->data, ip,
+           length < capture->snaplen ? length : capture->snaplen);
+
+    atomic_store_explicit(&ring->tail, (tail + 1) % CAPTURE_RING_SLOTS,
+                          memory_order_release);
+}
+
+static void write_record(packet_capture *capture, capture_record *record) {
+    pcap_record_header header;
+    header.ts_sec = record->time.tv_sec;
+    header.ts_usec = record->time.tv_usec;
+    header.orig_len = record->length;
+    header.incl_len =
+        record->length < capture->snaplen ? record->length : capture->snaplen;
+
+    fwrite(&header, sizeof(header), 1, capture->file);
+    fwrite(record->data, header.incl_len, 1, capture->file);
+}
+
+static void drain(packet_capture *capture) {
+    capture_ring *rings = capture->rings;
+    size_t heads[2], tails[2];
+
+    for (int i = 0; i < 2; i++) {
+        heads[i] = atomic_load_explicit(&rings[i].head, memory_order_relaxed);
+        tails[i] = atomic_load_explicit(&rings[i].tail, memory_order_acquire);
+    }
+
+    // Merge the two directions so the file stays in time order
+    while (heads[0] != tails[0] || heads[1] != tails[1]) {
+        capture_record *next[2] = {NULL, NULL};
+        for (int i = 0; i < 2; i++) {
+            if (heads[i] != tails[i]) {
+                next[i] = (capture_record *)&rings[i]
+                              .slots[heads[i] * capture->slot_size];
+            }
+        }
+
+        int i = !next[0] || (next[1] && timercmp(&next[1]->time,
+                                                 &next[0]->time, <));
+        write_record(capture, next[i]);
+        heads[i] = (heads[i] + 1) % CAPTURE_RING_SLOTS;
+        atomic_store_explicit(&rings[i].head, heads[i], memory_order_release);
+    }
+    fflush(capture->file);
+}
+
+static void toggle(packet_capture *capture) {
+    if (capture->file) {
+        atomic_store(&capture->enabled, 0);
+        drain(capture);
+        fclose(capture->file);
+        capture->file = NULL;
+        printf("Capture to %s stopped, %lu packets missed\n", capture->path,
+               atomic_load(&capture->dropped));
+        return;
+    }
+
+    capture->file = fopen(capture->path, "w");
+    if (capture->file == NULL) {
+        perror(capture->path);
+        return;
+    }
+
+    pcap_header header = {0xa1b2c3d4, 2, 4, 0, 0, capture->snaplen,
+                          LINKTYPE_RAW};
+    fwrite(&header, sizeof(header), 1, capture->file);
+
+    // Anything a producer managed to add after the last capture stopped
+    // doesn't belong in this one
+    for (int i = 0; i < 2; i++) {
+        atomic_store(&capture->rings[i].head,
+                     atomic_load(&capture->rings[i].tail));
+    }
+    atomic_store(&capture->dropped, 0);
+    atomic_store(&capture->enabled, 1);
+    printf("Capturing to %s\n", capture->path);
+}
+
+static void *capture_thread(void *vargp) {
+    packet_capture *capture = (packet_capture *)vargp;
+
+    int kq = kqueue();
+    if (kq == -1) {
+        perror("kqueue");
+        exit(1);
+    }
+    struct kevent change;
+    EV_SET(&change, SIGUSR2, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+    if (kevent(kq, &change, 1, NULL, 0, NULL) == -1) {
+        perror("kevent");
+        exit(1);
+    }
+
+    const struct timespec interval = {0, CAPTURE_FLUSH_INTERVAL_MS * 1000000L};
+    while (1) {
+        // Only wake up to empty the rings while capturing
+        struct kevent event;
+        int count = kevent(kq, NULL, 0, &event, 1,
+                           capture->file ? &interval : NULL);
+        if (capture->file) {
+            drain(capture);
+        }
+        if (count == 1) {
+            toggle(capture);
+        }
+    }
+    return vargp;
+}
+
+void capture_start(packet_capture *capture, const char *path, int mtu) {
+    atomic_init(&capture->enabled, 0);
+    atomic_init(&capture->dropped, 0);
+    capture->snaplen = MAX_FRAME_SIZE(mtu);
+    capture->slot_size = (sizeof(capture_record) + capture->snaplen +
+                          CACHE_LINE_SIZE - 1) &
+                         ~(size_t)(CACHE_LINE_SIZE - 1);
+    // Kept for the capture thread, the caller's copy may not last
+    capture->path = strdup(path);
+    if (capture->path == NULL) {
+        perror("strdup");
+        exit(1);
+    }
+    capture->file = NULL;
+
+    for (int i = 0; i < 2; i++) {
+        atomic_init(&capture->rings[i].head, 0);
+        atomic_init(&capture->rings[i].tail, 0);
+        capture->rings[i].slots =
+            malloc(CAPTURE_RING_SLOTS * capture->slot_size);
+        if (capture->rings[i].slots == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+    }
+
+    // Ignored so the kqueue can pick it up instead of it killing us
+    signal(SIGUSR2, SIG_IGN);
+
+    pthread_t thread_id;
+    pthread_create(&thread_id, NULL, capture_thread, capture);
+}
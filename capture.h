@@ -0,0 +1,60 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/time.h>
+
+#include "pool.h"
+
+// Packet capture to a pcap file, toggled at runtime with SIGUSR2. The hot
+// paths only copy the IP packet into a ring for their direction, a
+// background thread writes the rings out. If a ring is full the packet is
+// left out of the capture rather than slowing the link down.
+
+#define CAPTURE_TX 0
+#define CAPTURE_RX 1
+
+#define CAPTURE_RING_SLOTS 256
+
+// How often the background thread empties the rings while capturing
+#define CAPTURE_FLUSH_INTERVAL_MS 50
+
+#define LINKTYPE_RAW 101 // bare IPv4/IPv6 packets
+
+typedef struct capture_record {
+    struct timeval time;
+    int length;
+    unsigned char data[];
+} capture_record;
+
+// Single producer, single consumer, like packet_queue, but the slots hold
+// copies of the packets
+typedef struct capture_ring {
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t head; // only written by consumer
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t tail; // only written by producer
+    unsigned char *slots;
+} capture_ring;
+
+typedef struct packet_capture {
+    atomic_int enabled;
+    atomic_ulong dropped;
+    capture_ring rings[2];
+    size_t slot_size;
+    int snaplen;
+
+    // Background thread only
+    const char *path;
+    FILE *file;
+} packet_capture;
+
+// Allocates the rings and starts the thread that waits for SIGUSR2. Nothing
+// is captured until then.
+void capture_start(packet_capture *capture, const char *path, int mtu);
+
+// Copies the packet into the ring for direction if capture is on
+void capture_packet(packet_capture *capture, int direction,
+                    const unsigned char *ip, int length);
+
+#endif
@@ -0,0 +1,396 @@
+#include "codec.h"
+
+#include <mach/mach_time.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON_KERNELS
+#endif
+
+// Scan kernels return the offset of the first END or ESC byte in
+// in[0..length), or length if there isn't one. Everything before that offset
+// can be copied as-is.
+typedef size_t (*scan_kernel)(const unsigned char *in, size_t length);
+
+static size_t scan_scalar(const unsigned char *in, size_t length) {
+    size_t i;
+    for (i = 0; i < length; i++) {
+        if (in[i] == END || in[i] == ESC) {
+            break;
+        }
+    }
+    return i;
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("sse2"))) static size_t
+scan_sse2(const unsigned char *in, size_t length) {
+    const __m128i end = _mm_set1_epi8((char)END);
+    const __m128i esc = _mm_set1_epi8((char)ESC);
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+        __m128i hit =
+            _mm_or_si128(_mm_cmpeq_epi8(v, end), _mm_cmpeq_epi8(v, esc));
+        int mask = _mm_movemask_epi8(hit);
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + scan_scalar(in + i, length - i);
+}
+
+__attribute__((target("avx2"))) static size_t
+scan_avx2(const unsigned char *in, size_t length) {
+    const __m256i end = _mm256_set1_epi8((char)END);
+    const __m256i esc = _mm256_set1_epi8((char)ESC);
+    size_t i = 0;
+
+    for (; i + 32 <= length; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(in + i));
+        __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi8(v, end),
+                                      _mm256_cmpeq_epi8(v, esc));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(hit);
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + scan_sse2(in + i, length - i);
+}
+#endif
+
+#ifdef HAVE_NEON_KERNELS
+static size_t scan_neon(const unsigned char *in, size_t length) {
+    const uint8x16_t end = vdupq_n_u8(END);
+    const uint8x16_t esc = vdupq_n_u8(ESC);
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        uint8x16_t v = vld1q_u8(in + i);
+        uint8x16_t hit = vorrq_u8(vceqq_u8(v, end), vceqq_u8(v, esc));
+        // Narrow the 16 byte mask to 4 bits per byte so it fits in a
+        // general purpose register, there is no movemask on NEON.
+        uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(hit), 4);
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(nibbles), 0);
+        if (mask) {
+            return i + (__builtin_ctzll(mask) >> 2);
+        }
+    }
+    return i + scan_scalar(in + i, length - i);
+}
+#endif
+
+static scan_kernel scan = scan_scalar;
+static const char *scan_name = "scalar";
+
+int slip_select_kernel(const char *name) {
+    scan_kernel kernel = scan_scalar;
+    const char *kernel_name = "scalar";
+
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (name == NULL || strcmp(name, "avx2") == 0) {
+        if (__builtin_cpu_supports("avx2")) {
+            kernel = scan_avx2;
+            kernel_name = "avx2";
+        } else if (name != NULL) {
+            return -1;
+        }
+    }
+    if (kernel == scan_scalar &&
+        (name == NULL || strcmp(name, "sse2") == 0)) {
+        if (__builtin_cpu_supports("sse2")) {
+            kernel = scan_sse2;
+            kernel_name = "sse2";
+        } else if (name != NULL) {
+            return -1;
+        }
+    }
+#endif
+#ifdef HAVE_NEON_KERNELS
+    // NEON is always present on 64-bit ARM
+    if (name == NULL || strcmp(name, "neon") == 0) {
+        kernel = scan_neon;
+        kernel_name = "neon";
+    }
+#endif
+
+    if (name != NULL && strcmp(name, kernel_name) != 0) {
+        return -1;
+    }
+
+    scan = kernel;
+    scan_name = kernel_name;
+    return 0;
+}
+
+const char *slip_kernel_name(void) { return scan_name; }
+
+int encode_slip(const unsigned char *in, unsigned char *out, int length) {
+    unsigned char *start = out;
+    size_t remaining = length;
+
+    while (remaining > 0) {
+        // Copy everything up to the next byte that needs escaping in one go
+        size_t run = scan(in, remaining);
+        memcpy(out, in, run);
+        in += run;
+        out += run;
+        remaining -= run;
+
+        if (remaining == 0) {
+            break;
+        }
+
+        *out++ = ESC;
+        *out++ = (*in == END) ? ESC_END : ESC_ESC;
+        in++;
+        remaining--;
+    }
+
+    *out = END;
+    out++;
+
+    return out - start;
+}
+
+static const unsigned char escaped_end[] = {ESC, ESC_END};
+static const unsigned char escaped_esc[] = {ESC, ESC_ESC};
+static const unsigned char end_of_packet[] = {END};
+
+int encode_slip_iov(const unsigned char *in, int length, struct iovec *iov,
+                    int iovcnt) {
+    size_t remaining = length;
+    int n = 0;
+
+    while (remaining > 0) {
+        size_t run = scan(in, remaining);
+        if (run > 0) {
+            if (n == iovcnt) {
+                return -1;
+            }
+            iov[n].iov_base = (void *)in;
+            iov[n].iov_len = run;
+            n++;
+            in += run;
+            remaining -= run;
+        }
+
+        if (remaining == 0) {
+            break;
+        }
+
+        if (n == iovcnt) {
+            return -1;
+        }
+        iov[n].iov_base = (void *)((*in == END) ? escaped_end : escaped_esc);
+        iov[n].iov_len = 2;
+        n++;
+        in++;
+        remaining--;
+    }
+
+    if (n == iovcnt) {
+        return -1;
+    }
+    iov[n].iov_base = (void *)end_of_packet;
+    iov[n].iov_len = 1;
+
+    return n + 1;
+}
+
+// ESC END, a frame cut short where the escaped byte was lost
+#define DECODE_ERROR_AT_END -6
+
+static int decode_byte(int fd) {
+    unsigned char c;
+    if (read(fd, &c, 1) != 1) {
+        printf("Read error\n");
+        return -1;
+    }
+
+    if (c == ESC) {
+        // escape character - look at the next one too
+        if (read(fd, &c, 1) != 1) {
+            printf("Read error\n");
+            return -1;
+        }
+        if (c == ESC_END) {
+            return END;
+        } else if (c == ESC_ESC) {
+            return ESC;
+        } else {
+            return c == END ? DECODE_ERROR_AT_END : SLIP_DECODE_ERROR;
+        }
+    } else if (c == END) {
+        return DECODE_END_OF_PACKET;
+    } else {
+        return c;
+    }
+}
+
+int decode_slip(int fd) {
+    int result = decode_byte(fd);
+    return result == DECODE_ERROR_AT_END ? SLIP_DECODE_ERROR : result;
+}
+
+int next_slip_packet(int fd, unsigned char *buf, int size) {
+    int i = 0;
+    int too_long = 0;
+    int corrupt = 0;
+    while (1) {
+        int result = decode_byte(fd);
+        if (result == -1) {
+            return result;
+        } else if (result == DECODE_ERROR_AT_END) {
+            return SLIP_DECODE_ERROR;
+        } else if (result == SLIP_DECODE_ERROR) {
+            // Resync at the next END rather than give up on the device
+            corrupt = 1;
+        } else if (result == DECODE_END_OF_PACKET) {
+            // full packet
+            if (corrupt) {
+                return SLIP_DECODE_ERROR;
+            }
+            return too_long ? SLIP_PACKET_TOO_LONG : i;
+        } else if (corrupt) {
+            continue;
+        } else if (i == size) {
+            // keep going to find the end, but don't store anything
+            too_long = 1;
+        } else {
+            buf[i] = (unsigned char)result;
+            i++;
+        }
+    }
+}
+
+void slip_reader_init(slip_reader *reader, int fd) {
+    reader->fd = fd;
+    reader->escaped = 0;
+    reader->too_long = 0;
+    reader->corrupt = 0;
+    reader->length = 0;
+    reader->pos = 0;
+    reader->len = 0;
+    reader->bytes_read = 0;
+    reader->timestamps = 0;
+    reader->fill_time = 0;
+    reader->started = 0;
+}
+
+ssize_t slip_reader_fill(slip_reader *reader) {
+    // read() returns as soon as any data is available so this never waits
+    // for the whole buffer to fill.
+    ssize_t n = read(reader->fd, reader->buf, sizeof(reader->buf));
+    if (n > 0) {
+        reader->pos = 0;
+        reader->len = n;
+        reader->bytes_read += n;
+        if (reader->timestamps) {
+            reader->fill_time = mach_absolute_time();
+        }
+    }
+    return n;
+}
+
+int slip_decode_buffered(slip_reader *reader, unsigned char *buf, int size) {
+    int i = reader->length;
+
+    if (i == 0 && !reader->escaped) {
+        // Nothing of this packet has been seen before this chunk
+        reader->started = reader->fill_time;
+    }
+
+    while (reader->pos < reader->len) {
+        if (!reader->escaped) {
+            // Copy the run of plain bytes up to the next END/ESC
+            size_t run =
+                scan(&reader->buf[reader->pos], reader->len - reader->pos);
+            if (reader->corrupt) {
+                // Skipping to the next END anyway
+            } else if (run > (size_t)(size - i)) {
+                // Keep what fits and skip the rest of the frame
+                reader->too_long = 1;
+                memcpy(&buf[i], &reader->buf[reader->pos], size - i);
+                i = size;
+            } else {
+                memcpy(&buf[i], &reader->buf[reader->pos], run);
+                i += run;
+            }
+            reader->pos += run;
+            if (reader->pos == reader->len) {
+                break;
+            }
+        }
+
+        unsigned char c = reader->buf[reader->pos++];
+
+        if (reader->escaped) {
+            reader->escaped = 0;
+            if (c == END) {
+                // A lost byte after the ESC, the frame ends here
+                reader->length = 0;
+                reader->too_long = 0;
+                reader->corrupt = 0;
+                return SLIP_DECODE_ERROR;
+            } else if (c != ESC_END && c != ESC_ESC) {
+                // Skip the rest of the frame and resync at the next END
+                reader->corrupt = 1;
+            } else if (reader->corrupt) {
+                continue;
+            } else if (i == size) {
+                reader->too_long = 1;
+            } else {
+                buf[i++] = (c == ESC_END) ? END : ESC;
+            }
+        } else if (c == ESC) {
+            // The escaped byte may be in the next chunk so remember we are
+            // part way through an escape.
+            reader->escaped = 1;
+        } else if (c == END) {
+            // full packet, anything after it is kept for next time
+            int too_long = reader->too_long;
+            int corrupt = reader->corrupt;
+            reader->length = 0;
+            reader->too_long = 0;
+            reader->corrupt = 0;
+            if (corrupt) {
+                return SLIP_DECODE_ERROR;
+            }
+            return too_long ? SLIP_PACKET_TOO_LONG : i;
+        } else if (reader->corrupt) {
+            continue;
+        } else if (i == size) {
+            reader->too_long = 1;
+        } else {
+            buf[i++] = c;
+        }
+    }
+
+    reader->length = i;
+    return SLIP_NEED_MORE;
+}
+
+int next_slip_packet_buffered(slip_reader *reader, unsigned char *buf,
+                              int size) {
+    while (1) {
+        int result = slip_decode_buffered(reader, buf, size);
+        if (result != SLIP_NEED_MORE) {
+            return result;
+        }
+
+        // Buffer used up, refill it with whatever the device has ready.
+        if (slip_reader_fill(reader) <= 0) {
+            printf("Read error\n");
+            return -1;
+        }
+    }
+}
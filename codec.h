@@ -0,0 +1,89 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define END 0xc0
+#define ESC 0xdb
+#define ESC_ESC 0xdd
+#define ESC_END 0xdc
+
+#define DECODE_END_OF_PACKET -2
+
+// Returned by next_slip_packet*() when a frame didn't fit in the buffer. The
+// rest of the frame has been skipped and decoding can carry on.
+#define SLIP_PACKET_TOO_LONG -3
+
+// Returned by slip_decode_buffered() when it has used up the buffered bytes
+// part way through a packet.
+#define SLIP_NEED_MORE -4
+
+// Returned by the decoders when ESC is followed by something other than
+// ESC_END or ESC_ESC. Like a packet that is too long, the rest of the frame
+// has been skipped, up to the next END, and decoding can carry on.
+#define SLIP_DECODE_ERROR -5
+
+// Packets that would encode to more iovecs than this are cheaper to copy into
+// a buffer than to hand to writev() piece by piece.
+#define SLIP_MAX_IOV 16
+
+// How much we ask the device for in one read() when using the buffered
+// decoder. Large enough to hold several full frames at once.
+#define SLIP_READ_BUFFER_SIZE 16384
+
+// State for the buffered decoder. Bytes are read from the device in large
+// chunks and decoded from the buffer, so anything left over after the end of
+// one packet is kept for the next call. The packet being decoded is kept too,
+// which lets it be fed from a non-blocking fd a chunk at a time.
+typedef struct slip_reader {
+    int fd;
+    int escaped;  // last byte decoded was ESC
+    int too_long; // current packet didn't fit and is being skipped
+    int corrupt;  // current packet had a bad escape and is being skipped
+    int length;   // bytes of the current packet decoded so far
+    size_t pos;   // next byte in buf to decode
+    size_t len;   // number of valid bytes in buf
+    unsigned long bytes_read; // in total, for statistics
+    int timestamps;           // set to keep fill_time and started
+    uint64_t fill_time;       // mach_absolute_time() of the last fill
+    uint64_t started;         // fill_time when the current packet began
+    unsigned char buf[SLIP_READ_BUFFER_SIZE];
+} slip_reader;
+
+// Picks the fastest scan kernel this CPU supports for finding bytes that
+// need escaping. name forces a specific kernel ("scalar", "sse2", "avx2" or
+// "neon"), or NULL to choose automatically. Returns -1 if the kernel is not
+// available. Until this is called the scalar kernel is used.
+int slip_select_kernel(const char *name);
+const char *slip_kernel_name(void);
+
+int encode_slip(const unsigned char *in, unsigned char *out, int length);
+
+// Describes the SLIP encoding of in as iovecs for writev(): runs of bytes that
+// need no escaping point straight into in, escapes and the END point to
+// static data, so nothing is copied. Returns the number of iovecs filled, or
+// -1 if more than iovcnt would be needed.
+int encode_slip_iov(const unsigned char *in, int length, struct iovec *iov,
+                    int iovcnt);
+
+// Per-byte decoder, one read() per byte on the wire.
+int decode_slip(int fd);
+int next_slip_packet(int fd, unsigned char *buf, int size);
+
+// Buffered decoder.
+void slip_reader_init(slip_reader *reader, int fd);
+int next_slip_packet_buffered(slip_reader *reader, unsigned char *buf,
+                              int size);
+
+// The two halves of next_slip_packet_buffered() for use with non-blocking
+// fds. slip_reader_fill() does one read() into the (used up) buffer and
+// returns its result. slip_decode_buffered() decodes from the buffer into buf
+// and returns the packet length once one is complete, or SLIP_NEED_MORE;
+// the same buf must be passed in until then.
+ssize_t slip_reader_fill(slip_reader *reader);
+int slip_decode_buffered(slip_reader *reader, unsigned char *buf, int size);
+
+#endif
@@ -0,0 +1,95 @@
+#include "compress.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static compression_algorithm algorithm(int frame_type) {
+    return frame_type == FRAME_LZ4 ? COMPRESSION_LZ4_RAW : COMPRESSION_ZLIB;
+}
+
+static void *scratch_alloc(size_t size) {
+    // Decoding LZ4 needs no scratch space at all
+    void *scratch = malloc(size > 0 ? size : 1);
+    if (scratch == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    return scratch;
+}
+
+int frame_compressor_init(frame_compressor *compressor, const char *name,
+                          int min_size, int mtu) {
+    if (strcmp(name, "lz4") == 0) {
+        compressor->frame_type = FRAME_LZ4;
+    } else if (strcmp(name, "zlib") == 0) {
+        compressor->frame_type = FRAME_ZLIB;
+    } else {
+        return -1;
+    }
+    compressor->min_size = min_size;
+    compressor->mtu = mtu;
+
+    // The remote may send either, so RX needs room for whichever is bigger
+    size_t tx_size = compression_encode_scratch_buffer_size(
+        algorithm(compressor->frame_type));
+    size_t rx_size = compression_decode_scratch_buffer_size(COMPRESSION_ZLIB);
+    size_t lz4_size =
+        compression_decode_scratch_buffer_size(COMPRESSION_LZ4_RAW);
+    compressor->tx_scratch = scratch_alloc(tx_size);
+    compressor->rx_scratch = scratch_alloc(rx_size > lz4_size ? rx_size
+                                                              : lz4_size);
+
+    // One spare byte on RX to tell a frame that is too long from one that
+    // fits exactly
+    compressor->tx_buf = scratch_alloc(mtu);
+    compressor->rx_buf = scratch_alloc(mtu + 1);
+    return 0;
+}
+
+int compress_frame(frame_compressor *compressor, unsigned char **frame,
+                   int length) {
+    int type = FRAME_RAW;
+
+    // Only keep the result if it saves more than the framing byte
+    if (length >= compressor->min_size && length > 2) {
+        size_t n = compression_encode_buffer(
+            compressor->tx_buf, length - 2, *frame, length,
+            compressor->tx_scratch, algorithm(compressor->frame_type));
+        if (n > 0) {
+            memcpy(*frame, compressor->tx_buf, n);
+            length = n;
+            type = compressor->frame_type;
+        }
+    }
+
+    (*frame)--;
+    (*frame)[0] = type;
+    return length + 1;
+}
+
+int decompress_frame(frame_compressor *compressor, unsigned char **frame,
+                     int length) {
+    if (length < 1) {
+        return -1;
+    }
+
+    int type = (*frame)[0];
+    (*frame)++;
+    length--;
+
+    if (type == FRAME_RAW) {
+        return length;
+    } else if (type != FRAME_LZ4 && type != FRAME_ZLIB) {
+        return -1;
+    }
+
+    size_t n = compression_decode_buffer(
+        compressor->rx_buf, compressor->mtu + 1, *frame, length,
+        compressor->rx_scratch, algorithm(type));
+    if (n == 0 || n > (size_t)compressor->mtu) {
+        return -1;
+    }
+    memcpy(*frame, compressor->rx_buf, n);
+    return n;
+}
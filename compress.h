@@ -0,0 +1,45 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <compression.h>
+
+// Optional payload compression, for bulk transfers over links slow enough
+// that the CPU time is free. When it is on every frame starts with a byte
+// saying how the rest of it was compressed. Frames that don't get smaller are
+// sent as they are behind FRAME_RAW, so the worst case costs one byte.
+
+#define FRAME_RAW 0
+#define FRAME_LZ4 1
+#define FRAME_ZLIB 2
+
+// Frames are never compressed below this size by default, there is little to
+// gain and the framing byte would often make them bigger.
+#define DEFAULT_COMPRESS_MIN_SIZE 128
+
+typedef struct frame_compressor {
+    int frame_type;  // used for TX, RX handles any
+    int min_size;    // smaller frames are sent raw
+    int mtu;         // largest frame decompression may produce
+    void *tx_scratch; // libcompression working space for each direction
+    void *rx_scratch;
+    unsigned char *tx_buf; // compressed output before it is copied back
+    unsigned char *rx_buf;
+} frame_compressor;
+
+// name is "lz4" or "zlib" (raw deflate). Returns -1 for an unknown name.
+int frame_compressor_init(frame_compressor *compressor, const char *name,
+                          int min_size, int mtu);
+
+// Compresses the frame at *frame in place, adding the framing byte in front
+// of it, so there must be room for that before *frame. Returns the new
+// length.
+int compress_frame(frame_compressor *compressor, unsigned char **frame,
+                   int length);
+
+// Reverses compress_frame(). The frame stays where it is, after the framing
+// byte, and may be up to mtu bytes long; there must be room for that.
+// Returns the new length, or -1 if the frame should be dropped.
+int decompress_frame(frame_compressor *compressor, unsigned char **frame,
+                     int length);
+
+#endif
@@ -0,0 +1,136 @@
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "slip.h"
+
+int parse_baud(const char *arg) {
+    // Accepts any whole number of bits per second, with an optional k or M
+    // suffix, e.g. 921600, 1M or 3M.
+    char *end;
+    double value = strtod(arg, &end);
+
+    if (end == arg) {
+        return -1;
+    } else if (*end == 'k' || *end == 'K') {
+        value *= 1000;
+        end++;
+    } else if (*end == 'M') {
+        value *= 1000000;
+        end++;
+    }
+
+    if (*end != '\0' || value < 1 || value > 100000000 ||
+        value != (int)value) {
+        return -1;
+    }
+    return (int)value;
+}
+
+int config_check(const link_config *link) {
+    if (link->device_type != DEVICE_TYPE_HARDWARE &&
+        link->device_type != DEVICE_TYPE_SOCKET_SERVER &&
+        link->device_type != DEVICE_TYPE_SOCKET_CLIENT &&
+        link->device_type != DEVICE_TYPE_TCP &&
+        !IS_DATAGRAM(link->device_type)) {
+        return -1;
+    }
+    if (link->mtu < MIN_MTU || link->mtu > MAX_MTU || link->baud == -1) {
+        return -1;
+    }
+    if (!link->device_path || !link->local_ip || !link->remote_ip) {
+        return -1;
+    }
+
+    // Addresses are set without ifconfig, so they must be numeric
+    struct in_addr address;
+    if (inet_pton(AF_INET, link->local_ip, &address) != 1 ||
+        inet_pton(AF_INET, link->remote_ip, &address) != 1) {
+        return -1;
+    }
+    return 0;
+}
+
+static int parse_link(char *line, link_config *link, int default_baud,
+                      int default_mtu) {
+    char *words[7];
+    int count = 0;
+    char *word;
+
+    while (count < 7 && (word = strsep(&line, " \t\r\n")) != NULL) {
+        if (*word != '\0') {
+            words[count++] = word;
+        }
+    }
+    if (count < 5 || count > 6 || strlen(words[1]) != 1) {
+        return -1;
+    }
+
+    // Strings point into the line, which is kept for as long as we run
+    link->device_path = words[0];
+    link->device_type = words[1][0];
+    link->baud =
+        strcmp(words[2], "-") == 0 ? default_baud : parse_baud(words[2]);
+    link->local_ip = words[3];
+    link->remote_ip = words[4];
+    link->mtu = default_mtu;
+    if (count == 6) {
+        char *end;
+        long mtu = strtol(words[5], &end, 10);
+        link->mtu = *end == '\0' ? (int)mtu : -1;
+    }
+    return config_check(link);
+}
+
+int config_load(const char *path, link_config *links, int default_baud,
+                int default_mtu) {
+    char line[1024];
+    int line_number = 0;
+    int count = 0;
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), file)) {
+        line_number++;
+
+        char *comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+        if (strspn(line, " \t\r\n") == strlen(line)) {
+            continue;
+        }
+
+        if (count == CONFIG_MAX_LINKS) {
+            fprintf(stderr, "%s: more than %i links\n", path,
+                    CONFIG_MAX_LINKS);
+            fclose(file);
+            return -1;
+        }
+        char *copy = strdup(line);
+        if (copy == NULL) {
+            perror("strdup");
+            exit(1);
+        }
+        if (parse_link(copy, &links[count], default_baud, default_mtu) ==
+            -1) {
+            fprintf(stderr, "%s:%i: invalid link\n", path, line_number);
+            fclose(file);
+            return -1;
+        }
+        count++;
+    }
+
+    fclose(file);
+    if (count == 0) {
+        fprintf(stderr, "%s: no links\n", path);
+        return -1;
+    }
+    return count;
+}
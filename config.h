@@ -0,0 +1,38 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+// Links for one process to run, read from the file given with -C. Each line
+// is one link:
+//
+//     device type baud local_ip remote_ip [mtu]
+//
+// type is h, s, c, S, C, t or u as for -t, and baud may be - for the
+// default. Only h uses it, every socket type ignores it. # starts a comment.
+
+#define CONFIG_MAX_LINKS 256
+
+typedef struct link_config {
+    char device_type;
+    char *device_path;
+    int baud;
+    char *local_ip;
+    char *remote_ip;
+    int mtu;
+} link_config;
+
+// Accepts any whole number of bits per second, with an optional k or M
+// suffix, e.g. 921600, 1M or 3M. Returns -1 if arg isn't one.
+int parse_baud(const char *arg);
+
+// Fills links (room for CONFIG_MAX_LINKS) from the file at path, with
+// default_baud and default_mtu where a line leaves them out. Returns the
+// number of links, or -1 (having printed why) if the file can't be read or a
+// line doesn't parse.
+int config_load(const char *path, link_config *links, int default_baud,
+                int default_mtu);
+
+// Checks one link's settings, whether they came from a file or the command
+// line. Returns -1 if they can't be used.
+int config_check(const link_config *link);
+
+#endif
@@ -0,0 +1,151 @@
+#include "crc.h"
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_X86_CRC32
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define HAVE_ARM_CRC32
+#endif
+
+// Both are reflected, so the tables are indexed by the low byte
+#define CRC16_POLY 0x8408     // x^16 + x^12 + x^5 + 1, bit reversed
+#define CRC32C_POLY 0x82f63b78 // bit reversed
+
+static uint16_t crc16_table[256];
+static uint32_t crc32c_table[256];
+#ifdef HAVE_X86_CRC32
+static int have_sse42;
+#endif
+
+// Fills the tables before main(), so there's no first use race between the
+// link threads
+__attribute__((constructor)) static void crc_init(void) {
+#ifdef HAVE_X86_CRC32
+    __builtin_cpu_init();
+    have_sse42 = __builtin_cpu_supports("sse4.2");
+#endif
+    for (int i = 0; i < 256; i++) {
+        uint16_t c16 = i;
+        uint32_t c32 = i;
+        for (int bit = 0; bit < 8; bit++) {
+            c16 = (c16 & 1) ? (c16 >> 1) ^ CRC16_POLY : c16 >> 1;
+            c32 = (c32 & 1) ? (c32 >> 1) ^ CRC32C_POLY : c32 >> 1;
+        }
+        crc16_table[i] = c16;
+        crc32c_table[i] = c32;
+    }
+}
+
+uint16_t crc16(const unsigned char *data, size_t length) {
+    uint16_t crc = 0xffff;
+    for (size_t i = 0; i < length; i++) {
+        crc = (crc >> 8) ^ crc16_table[(crc ^ data[i]) & 0xff];
+    }
+    return ~crc;
+}
+
+static uint32_t crc32c_scalar(uint32_t crc, const unsigned char *data,
+                              size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        crc = (crc >> 8) ^ crc32c_table[(crc ^ data[i]) & 0xff];
+    }
+    return crc;
+}
+
+#ifdef HAVE_X86_CRC32
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_sse42(uint32_t crc, const unsigned char *data, size_t length) {
+    uint64_t crc64 = crc;
+    for (; length >= 8; data += 8, length -= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t)crc64;
+    for (; length > 0; data++, length--) {
+        crc = _mm_crc32_u8(crc, *data);
+    }
+    return crc;
+}
+#endif
+
+#ifdef HAVE_ARM_CRC32
+static uint32_t crc32c_arm(uint32_t crc, const unsigned char *data,
+                           size_t length) {
+    for (; length >= 8; data += 8, length -= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc = __crc32cd(crc, word);
+    }
+    for (; length > 0; data++, length--) {
+        crc = __crc32cb(crc, *data);
+    }
+    return crc;
+}
+#endif
+
+uint32_t crc32c(const unsigned char *data, size_t length) {
+#if defined(HAVE_X86_CRC32)
+    if (have_sse42) {
+        return ~crc32c_sse42(0xffffffff, data, length);
+    }
+#elif defined(HAVE_ARM_CRC32)
+    return ~crc32c_arm(0xffffffff, data, length);
+#endif
+    return ~crc32c_scalar(0xffffffff, data, length);
+}
+
+int frame_check_parse(const char *name) {
+    if (strcmp(name, "crc16") == 0) {
+        return FRAME_CHECK_CRC16;
+    } else if (strcmp(name, "crc32c") == 0) {
+        return FRAME_CHECK_CRC32C;
+    }
+    return -1;
+}
+
+int frame_check_size(int type) {
+    switch (type) {
+    case FRAME_CHECK_CRC16:
+        return 2;
+    case FRAME_CHECK_CRC32C:
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+// Trailers are little endian, the order the bits of a reflected CRC come
+// out in
+int frame_check_append(int type, unsigned char *frame, int length) {
+    if (type == FRAME_CHECK_CRC16) {
+        uint16_t crc = crc16(frame, length);
+        frame[length] = crc & 0xff;
+        frame[length + 1] = crc >> 8;
+    } else if (type == FRAME_CHECK_CRC32C) {
+        uint32_t crc = crc32c(frame, length);
+        for (int i = 0; i < 4; i++) {
+            frame[length + i] = crc >> (8 * i);
+        }
+    }
+    return length + frame_check_size(type);
+}
+
+int frame_check_verify(int type, const unsigned char *frame, int length) {
+    int size = frame_check_size(type);
+    if (length <= size) {
+        return size == 0 ? length : -1;
+    }
+    length -= size;
+
+    uint32_t expected = 0;
+    for (int i = 0; i < size; i++) {
+        expected |= (uint32_t)frame[length + i] << (8 * i);
+    }
+    uint32_t actual = type == FRAME_CHECK_CRC16 ? crc16(frame, length)
+                                                : crc32c(frame, length);
+    return actual == expected ? length : -1;
+}
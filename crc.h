@@ -0,0 +1,39 @@
+#ifndef CRC_H
+#define CRC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Optional check sequence appended to every frame before it is SLIP encoded,
+// so frames damaged on the wire are dropped instead of reaching the utun.
+// SLIP itself has no checksum, and the IP header checksum covers only the
+// header (and none at all on IPv6).
+
+#define FRAME_CHECK_NONE 0
+#define FRAME_CHECK_CRC16 1  // CRC-16/X.25, the PPP FCS (RFC 1662)
+#define FRAME_CHECK_CRC32C 2 // CRC-32C (Castagnoli), as used by iSCSI/SCTP
+
+// Largest trailer any frame check adds
+#define FRAME_CHECK_MAX_SIZE 4
+
+// name is "crc16" or "crc32c". Returns -1 for an unknown name.
+int frame_check_parse(const char *name);
+
+// Bytes of trailer the check adds to a frame
+int frame_check_size(int type);
+
+uint16_t crc16(const unsigned char *data, size_t length);
+
+// Uses the CRC32 instructions when the CPU has them (SSE4.2 or ARMv8),
+// otherwise a table.
+uint32_t crc32c(const unsigned char *data, size_t length);
+
+// Appends the check after frame, which must have room for it. Returns the
+// new length.
+int frame_check_append(int type, unsigned char *frame, int length);
+
+// Verifies and removes the check. Returns the length without it, or -1 if
+// the frame is damaged.
+int frame_check_verify(int type, const unsigned char *frame, int length);
+
+#endif
@@ -0,0 +1,140 @@
+#include "datagram.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "codec.h"
+#include "slip.h"
+
+int open_datagram_socket_as_server(slip_link *link) {
+    if (link->peer == NULL) {
+        link->peer = malloc(sizeof(datagram_peer));
+        if (link->peer == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        pthread_mutex_init(&link->peer->lock, NULL);
+    }
+    // A new socket has no client until one says hello
+    link->peer->length = 0;
+
+    return open_unix_domain_socket_as_server(link->device_path, SOCK_DGRAM);
+}
+
+int open_datagram_socket_as_client(const char *socket_path,
+                                   int error_is_fatal) {
+    struct sockaddr_un addr;
+    char own_path[sizeof(addr.sun_path)];
+
+    snprintf(own_path, sizeof(own_path), "%s.client", socket_path);
+    int fd = open_unix_domain_socket_as_server(own_path, SOCK_DGRAM);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        send(fd, "", 0, 0) == -1) {
+        if (error_is_fatal) {
+            perror("connect error");
+        }
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int device_gone(slip_link *link, int error) {
+    // The other end's socket was closed or its path removed. For UDP these
+    // only say a packet wasn't wanted, the other end may be back for the
+    // next one.
+    if (link->device_type != DEVICE_TYPE_DATAGRAM_CLIENT) {
+        return 0;
+    }
+    return error == ECONNREFUSED || error == ENOTCONN || error == ENOENT ||
+           error == EPIPE || error == EBADF;
+}
+
+int datagram_send(slip_link *link, const unsigned char *frame, int length) {
+    ssize_t sent;
+
+    if (link->peer) {
+        pthread_mutex_lock(&link->peer->lock);
+        if (link->peer->length == 0) {
+            pthread_mutex_unlock(&link->peer->lock);
+            STAT_ADD(link->stats.tx_write_errors, 1);
+            return 0;
+        }
+        sent = sendto(link->serialfd, frame, length, 0,
+                      (struct sockaddr *)&link->peer->address,
+                      link->peer->length);
+        pthread_mutex_unlock(&link->peer->lock);
+    } else {
+        sent = send(link->serialfd, frame, length, 0);
+    }
+
+    if (sent == length) {
+        STAT_ADD(link->stats.tx_wire_bytes, length);
+        return 0;
+    }
+    STAT_ADD(link->stats.tx_write_errors, 1);
+    if (sent != -1 || link->peer || !device_gone(link, errno)) {
+        // Full, or the server's client has gone away and it will wait for
+        // the next one to say hello
+        return 0;
+    }
+
+    // The server has gone, and nothing else would tell a reader blocked in
+    // recv(). Shutting the socket down wakes it up to reconnect.
+    shutdown(link->serialfd, SHUT_RDWR);
+    return -1;
+}
+
+int datagram_receive(slip_link *link, unsigned char *buf, int size) {
+    struct sockaddr_un from;
+    struct iovec iov = {buf, size};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (link->peer) {
+        msg.msg_name = &from;
+        msg.msg_namelen = sizeof(from);
+    }
+
+    ssize_t length = recvmsg(link->serialfd, &msg, 0);
+    if (length == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return SLIP_NEED_MORE;
+    } else if (length == -1 && (errno == EINTR || errno == ECONNREFUSED)) {
+        // ECONNREFUSED is UDP saying an earlier packet wasn't wanted
+        return 0;
+    } else if (length == -1) {
+        return -1;
+    }
+
+    if (link->peer) {
+        // Replies go to whoever sent last, so a restarted client is picked
+        // up as soon as it says hello
+        pthread_mutex_lock(&link->peer->lock);
+        if (msg.msg_namelen > 0) {
+            memcpy(&link->peer->address, &from, msg.msg_namelen);
+            link->peer->length = msg.msg_namelen;
+        }
+        pthread_mutex_unlock(&link->peer->lock);
+    } else if (length == 0 &&
+               link->device_type == DEVICE_TYPE_DATAGRAM_CLIENT) {
+        // The server never sends empty datagrams, so this is our own
+        // shutdown() from datagram_send()
+        return -1;
+    }
+
+    STAT_ADD(link->stats.rx_wire_bytes, length);
+    if (msg.msg_flags & MSG_TRUNC) {
+        return SLIP_PACKET_TOO_LONG;
+    }
+    return length;
+}
@@ -0,0 +1,46 @@
+#ifndef DATAGRAM_H
+#define DATAGRAM_H
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Packet socket devices (-t S, -t C and -t u). Each frame is one AF_UNIX or
+// UDP datagram, so there is no SLIP framing at all: nothing to escape, and
+// one send() and one recv() per packet. The AF_UNIX ones are meant for an
+// emulator on the same Mac.
+//
+// The server binds the path and replies to whoever last sent to it, so the
+// client can come and go. The client binds path.client for the replies and
+// says hello with an empty datagram, so the server knows where it is before
+// it has any packets to send.
+
+// The kernel's default AF_UNIX datagram buffers hold two or three packets.
+// Used unless -S says otherwise.
+#define DATAGRAM_BUFFER_SIZE 262144
+
+typedef struct datagram_peer {
+    pthread_mutex_t lock; // the reader updates it while the writer sends
+    struct sockaddr_un address;
+    socklen_t length; // 0 until the client has been heard from
+} datagram_peer;
+
+struct slip_link;
+
+int open_datagram_socket_as_server(struct slip_link *link);
+int open_datagram_socket_as_client(const char *socket_path,
+                                   int error_is_fatal);
+
+// Sends one frame to the device. Frames that can't be sent right now, or
+// with no client to send them to, are dropped and counted. Returns -1 if
+// the device should be reconnected.
+int datagram_send(struct slip_link *link, const unsigned char *frame,
+                  int length);
+
+// Receives one frame of up to size bytes into buf and returns its length.
+// Otherwise returns 0 for a hello, SLIP_PACKET_TOO_LONG, SLIP_NEED_MORE if
+// a non-blocking socket has nothing, or -1 if the device should be
+// reconnected.
+int datagram_receive(struct slip_link *link, unsigned char *buf, int size);
+
+#endif
@@ -0,0 +1,234 @@
+#include "filter.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+static int parse_number(const char *arg, long max, long *value) {
+    char *end;
+    *value = strtol(arg, &end, 10);
+    return end != arg && *end == '\0' && *value >= 0 && *value <= max ? 0
+                                                                       : -1;
+}
+
+static int parse_ports(char *arg, filter_rule *rule) {
+    long low, high;
+    char *dash = strchr(arg, '-');
+    if (dash) {
+        *dash = '\0';
+    }
+    if (parse_number(arg, 65535, &low) == -1 ||
+        parse_number(dash ? dash + 1 : arg, 65535, &high) == -1 ||
+        high < low) {
+        return -1;
+    }
+    rule->port_low = low;
+    rule->port_high = high;
+    return 0;
+}
+
+static int parse_address(char *arg, filter_rule *rule) {
+    long length = -1;
+    char *slash = strchr(arg, '/');
+    if (slash) {
+        *slash = '\0';
+    }
+
+    if (inet_pton(AF_INET, arg, rule->address) == 1) {
+        rule->family = AF_INET;
+        rule->prefix_length = 32;
+    } else if (inet_pton(AF_INET6, arg, rule->address) == 1) {
+        rule->family = AF_INET6;
+        rule->prefix_length = 128;
+    } else {
+        return -1;
+    }
+
+    if (slash) {
+        if (parse_number(slash + 1, rule->prefix_length, &length) == -1) {
+            return -1;
+        }
+        rule->prefix_length = length;
+    }
+    return 0;
+}
+
+static int parse_rule(char *line, filter_rule *rule) {
+    const char *separators = " \t\r\n";
+    char *word = strtok(line, separators);
+
+    rule->protocol = -1;
+    rule->port_low = 0;
+    rule->port_high = 65535;
+    rule->family = 0;
+    atomic_init(&rule->matched, 0);
+
+    if (strcmp(word, "drop") == 0) {
+        rule->action = FILTER_DROP;
+    } else if (strcmp(word, "pass") == 0) {
+        rule->action = FILTER_PASS;
+    } else {
+        return -1;
+    }
+
+    while ((word = strtok(NULL, separators)) != NULL) {
+        char *arg = NULL;
+        long protocol;
+
+        if (strcmp(word, "tcp") == 0) {
+            rule->protocol = IPPROTO_TCP;
+            continue;
+        } else if (strcmp(word, "udp") == 0) {
+            rule->protocol = IPPROTO_UDP;
+            continue;
+        } else if (strcmp(word, "icmp") == 0) {
+            rule->protocol = IPPROTO_ICMP;
+            continue;
+        } else if (strcmp(word, "icmp6") == 0) {
+            rule->protocol = IPPROTO_ICMPV6;
+            continue;
+        }
+
+        // Everything else takes an argument
+        arg = strtok(NULL, separators);
+        if (arg == NULL) {
+            return -1;
+        } else if (strcmp(word, "proto") == 0) {
+            if (parse_number(arg, 255, &protocol) == -1) {
+                return -1;
+            }
+            rule->protocol = protocol;
+        } else if (strcmp(word, "port") == 0) {
+            if (parse_ports(arg, rule) == -1) {
+                return -1;
+            }
+        } else if (strcmp(word, "dst") == 0) {
+            if (parse_address(arg, rule) == -1) {
+                return -1;
+            }
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int filter_load(packet_filter *filter, const char *path) {
+    char line[256];
+    int line_number = 0;
+
+    filter->count = 0;
+    atomic_init(&filter->dropped, 0);
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), file)) {
+        line_number++;
+
+        char *comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+        if (strspn(line, " \t\r\n") == strlen(line)) {
+            continue;
+        }
+
+        if (filter->count == FILTER_MAX_RULES) {
+            fprintf(stderr, "%s: more than %i rules\n", path,
+                    FILTER_MAX_RULES);
+            fclose(file);
+            return -1;
+        }
+        if (parse_rule(line, &filter->rules[filter->count]) == -1) {
+            fprintf(stderr, "%s:%i: invalid rule\n", path, line_number);
+            fclose(file);
+            return -1;
+        }
+        filter->count++;
+    }
+
+    fclose(file);
+    return 0;
+}
+
+static int prefix_matches(const unsigned char *a, const unsigned char *b,
+                          int bits) {
+    int bytes = bits / 8;
+    if (memcmp(a, b, bytes) != 0) {
+        return 0;
+    }
+    bits %= 8;
+    if (bits == 0) {
+        return 1;
+    }
+    unsigned char mask = 0xff << (8 - bits);
+    return (a[bytes] & mask) == (b[bytes] & mask);
+}
+
+int filter_packet(packet_filter *filter, const unsigned char *ip,
+                  int length) {
+    int family, protocol, header_length;
+    const unsigned char *dst;
+    int port = -1;
+
+    if (length >= 20 && (ip[0] >> 4) == 4) {
+        family = AF_INET;
+        protocol = ip[9];
+        dst = &ip[16];
+        header_length = (ip[0] & 0x0f) * 4;
+        // Only the first fragment has the ports, and a header shorter than
+        // the minimum would have them read from inside it
+        if (header_length < 20 || (ip[6] & 0x1f) != 0 || ip[7] != 0) {
+            header_length = length;
+        }
+    } else if (length >= 40 && (ip[0] >> 4) == 6) {
+        // Extension headers aren't followed, anything behind one only
+        // matches rules without a port
+        family = AF_INET6;
+        protocol = ip[6];
+        dst = &ip[24];
+        header_length = 40;
+    } else {
+        return FILTER_PASS;
+    }
+
+    // A packet truncated before the end of the ports has none, and only
+    // matches rules without a port
+    if ((protocol == IPPROTO_TCP || protocol == IPPROTO_UDP) &&
+        length >= header_length + 4) {
+        port = ip[header_length + 2] << 8 | ip[header_length + 3];
+    }
+
+    for (int i = 0; i < filter->count; i++) {
+        filter_rule *rule = &filter->rules[i];
+
+        if (rule->protocol != -1 && rule->protocol != protocol) {
+            continue;
+        }
+        if (rule->port_low != 0 || rule->port_high != 65535) {
+            if (port < rule->port_low || port > rule->port_high) {
+                continue;
+            }
+        }
+        if (rule->family != 0 &&
+            (rule->family != family ||
+             !prefix_matches(rule->address, dst, rule->prefix_length))) {
+            continue;
+        }
+
+        atomic_fetch_add_explicit(&rule->matched, 1, memory_order_relaxed);
+        if (rule->action == FILTER_DROP) {
+            atomic_fetch_add_explicit(&filter->dropped, 1,
+                                      memory_order_relaxed);
+        }
+        return rule->action;
+    }
+    return FILTER_PASS;
+}
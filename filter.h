@@ -0,0 +1,47 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+// Static rule table for dropping traffic the remote has no use for (mDNS,
+// NetBIOS, SSDP, broadcasts...) before it takes up time on the serial line.
+//
+// Rules are loaded from a file, one per line, and the first one that matches
+// decides. Packets that match no rule are passed. Each line is an action
+// followed by any of:
+//
+//     drop|pass [tcp|udp|icmp|proto N] [port N[-M]] [dst ADDR[/LEN]]
+//
+// port matches the destination port, dst the destination address (IPv4 or
+// IPv6). # starts a comment.
+
+#define FILTER_PASS 0
+#define FILTER_DROP 1
+
+#define FILTER_MAX_RULES 64
+
+typedef struct filter_rule {
+    int action;
+    int protocol; // -1 for any
+    uint16_t port_low, port_high; // 0-65535 for any
+    int family; // 0 for any address
+    int prefix_length;
+    unsigned char address[16];
+    atomic_ulong matched;
+} filter_rule;
+
+typedef struct packet_filter {
+    filter_rule rules[FILTER_MAX_RULES];
+    int count;
+    atomic_ulong dropped;
+} packet_filter;
+
+// Returns -1 (having printed why) if the file can't be read or a rule
+// doesn't parse.
+int filter_load(packet_filter *filter, const char *path);
+
+// Returns FILTER_PASS or FILTER_DROP for the IP packet at ip
+int filter_packet(packet_filter *filter, const unsigned char *ip, int length);
+
+#endif
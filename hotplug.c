@@ -0,0 +1,79 @@
+#include <CoreFoundation/CoreFoundation.h>
+#include <IOKit/IOKitLib.h>
+#include <IOKit/serial/IOSerialKeys.h>
+#include <dispatch/dispatch.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "slip.h"
+
+// Wakes up the reconnect loop as soon as the serial device comes back, e.g.
+// when the USB adapter is plugged in again, rather than it waiting out its
+// backoff.
+
+static int is_our_device(slip_link *link, io_object_t service) {
+    char path[1024];
+    int matched = 0;
+
+    // The device may have been given as either its callout (cu.) or dialin
+    // (tty.) node
+    CFStringRef keys[] = {CFSTR(kIOCalloutDeviceKey),
+                          CFSTR(kIODialinDeviceKey)};
+    for (int i = 0; i < 2 && !matched; i++) {
+        CFTypeRef value = IORegistryEntryCreateCFProperty(
+            service, keys[i], kCFAllocatorDefault, 0);
+        if (value == NULL) {
+            continue;
+        }
+        if (CFGetTypeID(value) == CFStringGetTypeID() &&
+            CFStringGetCString((CFStringRef)value, path, sizeof(path),
+                               kCFStringEncodingUTF8)) {
+            matched = strcmp(path, link->device_path) == 0;
+        }
+        CFRelease(value);
+    }
+    return matched;
+}
+
+static void serial_devices_added(void *refcon, io_iterator_t iterator) {
+    slip_link *link = (slip_link *)refcon;
+    io_object_t service;
+    int arrived = 0;
+
+    // The iterator has to be emptied for the notification to fire again
+    while ((service = IOIteratorNext(iterator))) {
+        arrived |= is_our_device(link, service);
+        IOObjectRelease(service);
+    }
+
+    if (arrived) {
+        dispatch_semaphore_signal(link->device_arrived);
+    }
+}
+
+void watch_for_device(slip_link *link) {
+    IONotificationPortRef port = IONotificationPortCreate(MACH_PORT_NULL);
+    if (port == NULL) {
+        fprintf(stderr, "Unable to watch for serial devices, will poll\n");
+        return;
+    }
+    IONotificationPortSetDispatchQueue(
+        port, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0));
+
+    io_iterator_t iterator;
+    if (IOServiceAddMatchingNotification(
+            port, kIOFirstMatchNotification,
+            IOServiceMatching(kIOSerialBSDServiceValue), serial_devices_added,
+            link, &iterator) != KERN_SUCCESS) {
+        fprintf(stderr, "Unable to watch for serial devices, will poll\n");
+        return;
+    }
+
+    // Devices already present are reported straight away. Go through them
+    // to arm the notification. Whether ours is among them doesn't matter:
+    // either it is open already, or connect_device() is about to try it.
+    io_object_t service;
+    while ((service = IOIteratorNext(iterator))) {
+        IOObjectRelease(service);
+    }
+}
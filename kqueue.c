@@ -0,0 +1,439 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/event.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "codec.h"
+#include "datagram.h"
+#include "filter.h"
+#include "realtime.h"
+#include "slip.h"
+#include "timing.h"
+#include "vj.h"
+
+// Encoded packets waiting for the device to accept them. Once this can't take
+// another worst case packet we stop reading from the utun, so packets back up
+// in the kernel rather than in here. Always fits at least a few packets.
+#define TX_BUFFER_SIZE 65536
+#define TX_BUFFER_MIN_PACKETS 4
+
+typedef struct kqueue_engine {
+    int kq;
+    slip_link *link;
+
+    // Serial -> utun. The packet being decoded lives in rx_packet, after the
+    // headroom, until its END arrives.
+    slip_reader reader;
+    unsigned char *rx_packet;
+
+    // utun -> serial
+    unsigned char *utun_buf;
+    unsigned char *tx_buf;
+    size_t tx_size;
+    size_t tx_start;
+    size_t tx_end;
+    int utun_paused;
+    int waiting_for_write;
+    int device_failed; // a datagram send found the device gone
+} kqueue_engine;
+
+static void set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("fcntl(O_NONBLOCK)");
+        exit(1);
+    }
+}
+
+static void watch(kqueue_engine *engine, int fd, int filter, int flags) {
+    struct kevent change;
+    EV_SET(&change, fd, filter, flags, 0, 0, NULL);
+    if (kevent(engine->kq, &change, 1, NULL, 0, NULL) == -1) {
+        // Some serial drivers don't support kqueue at all
+        perror("kevent");
+        fprintf(stderr, "Device can't be used with -e kqueue, try -e "
+                        "threads\n");
+        exit(1);
+    }
+}
+
+static void device_connected(kqueue_engine *engine) {
+    slip_link *link = engine->link;
+
+    set_nonblocking(link->serialfd);
+    slip_reader_init(&engine->reader, link->serialfd);
+    engine->reader.timestamps = link->timing != NULL;
+    if (link->cslip) {
+        // The new remote knows nothing about the old one's connections, and
+        // knows nothing about ours either
+        vj_reset_rx(link->vj);
+        vj_reset_tx(link->vj);
+    }
+
+    // Whatever was queued for the old device is dropped along with it, and
+    // so is anything the kernel queued on the utun while we were away. By
+    // now it's mostly retransmits of packets that will be sent again anyway.
+    unsigned long stale = 0;
+    while (read(link->utunfd, engine->utun_buf,
+                PACKET_BUFFER_SIZE(link->mtu)) > 0) {
+        stale++;
+    }
+    STAT_ADD(link->stats.tx_outage_dropped, stale);
+    engine->tx_start = 0;
+    engine->tx_end = 0;
+    engine->waiting_for_write = 0;
+    engine->device_failed = 0;
+
+    watch(engine, link->serialfd, EVFILT_READ, EV_ADD | EV_ENABLE);
+    watch(engine, link->serialfd, EVFILT_WRITE, EV_ADD | EV_DISABLE);
+
+    if (engine->utun_paused) {
+        watch(engine, link->utunfd, EVFILT_READ, EV_ENABLE);
+        engine->utun_paused = 0;
+    }
+
+    printf("utun%i: SLIP connection up\n", link->utun_num);
+}
+
+static void device_lost(kqueue_engine *engine) {
+    slip_link *link = engine->link;
+
+    printf("utun%i: Device lost, attempting reconnect...\n",
+           link->utun_num);
+
+    // Closing the fd also removes its events from the kqueue. Nothing else
+    // uses the fd so it can be swapped for the new one straight away.
+    reconnect_device(link);
+    device_connected(engine);
+}
+
+// Writes as much of the TX buffer as the device will take. Returns -1 if the
+// device has gone.
+static int flush_tx(kqueue_engine *engine) {
+    slip_link *link = engine->link;
+
+    if (engine->device_failed) {
+        return -1;
+    }
+
+    while (engine->tx_start < engine->tx_end) {
+        uint64_t write_start = link->timing ? timing_now() : 0;
+        ssize_t n = write(link->serialfd, &engine->tx_buf[engine->tx_start],
+                          engine->tx_end - engine->tx_start);
+        if (link->timing && n > 0) {
+            histogram_record(&link->timing->tx_write, write_start,
+                             timing_now());
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // Device is full, carry on when it says it's writable
+            if (!engine->waiting_for_write) {
+                watch(engine, link->serialfd, EVFILT_WRITE, EV_ENABLE);
+                engine->waiting_for_write = 1;
+            }
+            return 0;
+        } else if (n == -1) {
+            STAT_ADD(link->stats.tx_write_errors, 1);
+            return -1;
+        }
+        engine->tx_start += n;
+    }
+
+    engine->tx_start = 0;
+    engine->tx_end = 0;
+    if (engine->waiting_for_write) {
+        watch(engine, link->serialfd, EVFILT_WRITE, EV_DISABLE);
+        engine->waiting_for_write = 0;
+    }
+    if (engine->utun_paused) {
+        watch(engine, link->utunfd, EVFILT_READ, EV_ENABLE);
+        engine->utun_paused = 0;
+    }
+    return 0;
+}
+
+// Reads and encodes everything queued on the utun, as far as there is room.
+// Returns -1 if the utun has failed.
+static int utun_readable(kqueue_engine *engine) {
+    slip_link *link = engine->link;
+    unsigned char *c = engine->utun_buf;
+    size_t worst_case = MAX_PACKET_SIZE_SLIP(link->mtu);
+
+    while (1) {
+        if (engine->tx_size - engine->tx_end < worst_case) {
+            // Move the unsent part back to the start to make room
+            memmove(engine->tx_buf, &engine->tx_buf[engine->tx_start],
+                    engine->tx_end - engine->tx_start);
+            engine->tx_end -= engine->tx_start;
+            engine->tx_start = 0;
+        }
+        if (engine->tx_size - engine->tx_end < worst_case) {
+            // Backpressure: leave packets in the kernel until the device
+            // catches up
+            watch(engine, link->utunfd, EVFILT_READ, EV_DISABLE);
+            engine->utun_paused = 1;
+            return 0;
+        }
+
+        ssize_t len = read(link->utunfd, &c[PACKET_HEADROOM -
+                                            NULL_LOOPBACK_HEADER_SIZE],
+                           MAX_PACKET_SIZE(link->mtu));
+        if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        } else if (len == -1) {
+            printf("error %i\n", errno);
+            return -1;
+        }
+
+        int length = remove_loopback_header(
+            link, &c[PACKET_HEADROOM - NULL_LOOPBACK_HEADER_SIZE], len);
+        unsigned char *ip = &c[PACKET_HEADROOM];
+        if (length == -1 ||
+            (link->filter &&
+             filter_packet(link->filter, ip, length) == FILTER_DROP)) {
+            continue;
+        }
+        STAT_ADD(link->stats.tx_packets, 1);
+        STAT_ADD(link->stats.tx_bytes, length);
+        if (link->capture) {
+            capture_packet(link->capture, CAPTURE_TX, ip, length);
+        }
+
+        // Once encoded a packet is just bytes in tx_buf, so here only the
+        // encoding is timed
+        uint64_t read_time = 0;
+        if (link->timing) {
+            read_time = timing_now();
+            signpost_tx_begin(c);
+        }
+
+        length = tx_stages(link, &ip, length);
+        if (length > 0) {
+            length = add_frame_check(link, ip, length);
+        }
+        if (length > 0 && IS_DATAGRAM(link->device_type)) {
+            // Sent as it is, there's no buffer to fill. If the device is
+            // full the packet is dropped like any other datagram.
+            STAT_ADD(link->stats.tx_frame_bytes, length);
+            uint64_t write_start = link->timing ? timing_now() : 0;
+            if (datagram_send(link, ip, length) == -1) {
+                engine->device_failed = 1;
+            }
+            if (link->timing) {
+                histogram_record(&link->timing->tx_write, write_start,
+                                 timing_now());
+            }
+        } else if (length > 0) {
+            STAT_ADD(link->stats.tx_frame_bytes, length);
+            int encoded =
+                encode_slip(ip, &engine->tx_buf[engine->tx_end], length);
+            STAT_ADD(link->stats.tx_wire_bytes, encoded);
+            engine->tx_end += encoded;
+        } else {
+            STAT_ADD(link->stats.tx_stage_dropped, 1);
+        }
+
+        if (link->timing) {
+            histogram_record(&link->timing->tx_encode, read_time,
+                             timing_now());
+            signpost_tx_end(c);
+        }
+        if (engine->device_failed) {
+            return 0;
+        }
+    }
+}
+
+// Passes a frame decoded into rx_packet, after the headroom, on to the utun.
+// started is when its first byte was read, with -T.
+static void deliver_frame(kqueue_engine *engine, int length,
+                          uint64_t started) {
+    slip_link *link = engine->link;
+    unsigned char *payload = &engine->rx_packet[PACKET_HEADROOM];
+
+    STAT_ADD(link->stats.rx_frame_bytes, length);
+    length = remove_frame_check(link, payload, length);
+    if (length == -1) {
+        STAT_ADD(link->stats.rx_crc_errors, 1);
+        rx_frame_lost(link);
+        return;
+    }
+
+    uint64_t decoded = 0;
+    if (link->timing) {
+        decoded = timing_now();
+        histogram_record(&link->timing->rx_wire, started, decoded);
+        signpost_rx_begin(payload);
+    }
+
+    unsigned char *ip = payload;
+    length = rx_stages(link, &ip, length);
+    if (length < 1) {
+        STAT_ADD(link->stats.rx_stage_dropped, 1);
+        if (link->timing) {
+            signpost_rx_end(payload);
+        }
+        return;
+    }
+    int ip_length = length;
+    if (link->capture) {
+        capture_packet(link->capture, CAPTURE_RX, ip, length);
+    }
+    length = add_loopback_header(&ip, length);
+
+    // The utun is non-blocking too. If it's full the packet is dropped,
+    // same as the kernel would do.
+    if (write(link->utunfd, ip, length) == -1) {
+        STAT_ADD(link->stats.rx_write_errors, 1);
+    } else {
+        STAT_ADD(link->stats.rx_packets, 1);
+        STAT_ADD(link->stats.rx_bytes, ip_length);
+    }
+
+    if (link->timing) {
+        uint64_t written = timing_now();
+        histogram_record(&link->timing->rx_write, decoded, written);
+        histogram_record(&link->timing->rx_total, started, written);
+        signpost_rx_end(payload);
+    }
+}
+
+// Receives every datagram the device has ready. Returns -1 if the device
+// has gone.
+static int datagrams_readable(kqueue_engine *engine) {
+    slip_link *link = engine->link;
+    unsigned char *payload = &engine->rx_packet[PACKET_HEADROOM];
+
+    while (1) {
+        int length = datagram_receive(link, payload, MAX_FRAME_SIZE(link->mtu));
+        if (length == SLIP_NEED_MORE) {
+            return 0;
+        } else if (length == SLIP_PACKET_TOO_LONG) {
+            STAT_ADD(link->stats.rx_too_long, 1);
+            rx_frame_lost(link);
+            continue;
+        } else if (length < 0) {
+            return -1;
+        } else if (length > 0) {
+            deliver_frame(engine, length, link->timing ? timing_now() : 0);
+        }
+    }
+}
+
+// Decodes whatever the device has ready and passes complete packets to the
+// utun. Returns -1 if the device has gone.
+static int device_readable(kqueue_engine *engine) {
+    slip_link *link = engine->link;
+    unsigned char *payload = &engine->rx_packet[PACKET_HEADROOM];
+
+    if (IS_DATAGRAM(link->device_type)) {
+        return datagrams_readable(engine);
+    }
+
+    ssize_t n = slip_reader_fill(&engine->reader);
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    } else if (n <= 0) {
+        printf("Read error\n");
+        return -1;
+    }
+    STAT_ADD(link->stats.rx_wire_bytes, n);
+
+    while (1) {
+        int length = slip_decode_buffered(&engine->reader, payload,
+                                          MAX_FRAME_SIZE(link->mtu));
+        if (length == SLIP_NEED_MORE) {
+            return 0;
+        } else if (length == SLIP_PACKET_TOO_LONG) {
+            STAT_ADD(link->stats.rx_too_long, 1);
+            rx_frame_lost(link);
+            continue;
+        } else if (length == SLIP_DECODE_ERROR) {
+            // Already skipped to the next frame, carry on
+            STAT_ADD(link->stats.rx_decode_errors, 1);
+            rx_frame_lost(link);
+            continue;
+        } else if (length < 0) {
+            return -1;
+        } else if (length < 1) {
+            continue;
+        }
+        deliver_frame(engine, length, engine->reader.started);
+    }
+}
+
+void run_kqueue_engine(slip_link *link) {
+    // One per link, several links may be running at once
+    kqueue_engine *engine = calloc(1, sizeof(kqueue_engine));
+    if (engine == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+
+    // Both directions run on this thread, so its tag only serves to keep
+    // links apart
+    forwarding_thread_started(link, THREAD_TX);
+
+    engine->link = link;
+    engine->kq = kqueue();
+    if (engine->kq == -1) {
+        perror("kqueue");
+        exit(1);
+    }
+
+    size_t min_size = TX_BUFFER_MIN_PACKETS * MAX_PACKET_SIZE_SLIP(link->mtu);
+    engine->tx_size = TX_BUFFER_SIZE > min_size ? TX_BUFFER_SIZE : min_size;
+    engine->tx_buf = malloc(engine->tx_size);
+    engine->utun_buf = malloc(PACKET_BUFFER_SIZE(link->mtu));
+    engine->rx_packet = malloc(PACKET_BUFFER_SIZE(link->mtu));
+    if (!engine->tx_buf || !engine->utun_buf || !engine->rx_packet) {
+        perror("malloc");
+        exit(1);
+    }
+
+    set_nonblocking(link->utunfd);
+    watch(engine, link->utunfd, EVFILT_READ, EV_ADD | EV_ENABLE);
+    device_connected(engine);
+
+    while (1) {
+        struct kevent events[8];
+        int count = kevent(engine->kq, NULL, 0, events, 8, NULL);
+        if (count == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("kevent");
+            exit(1);
+        }
+
+        for (int i = 0; i < count; i++) {
+            int fd = (int)events[i].ident;
+            int device_ok = 0;
+
+            if (fd == link->utunfd) {
+                if (utun_readable(engine) == -1) {
+                    return;
+                }
+                device_ok = flush_tx(engine) == 0;
+            } else if (fd != link->serialfd) {
+                // Left over event for a device we have already replaced
+                continue;
+            } else if (events[i].filter == EVFILT_READ) {
+                device_ok = device_readable(engine) == 0;
+            } else {
+                device_ok = flush_tx(engine) == 0;
+            }
+
+            if (!device_ok) {
+                device_lost(engine);
+                // Events after this one may refer to the old device
+                break;
+            }
+        }
+    }
+}
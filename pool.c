@@ -0,0 +1,67 @@
+#include "pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define FREE_HEAD(tag, handle) (((uint64_t)(tag) << 32) | (handle))
+#define FREE_HEAD_TAG(head) ((uint32_t)((head) >> 32))
+#define FREE_HEAD_HANDLE(head) ((packet_handle)((head) & 0xffffffff))
+
+void packet_pool_init(packet_pool *pool, size_t count, int mtu) {
+    pool->buffer_size = (PACKET_BUFFER_SIZE(mtu) + CACHE_LINE_SIZE - 1) &
+                        ~(size_t)(CACHE_LINE_SIZE - 1);
+    pool->count = count;
+
+    pool->packets = calloc(count, sizeof(packet));
+    if (pool->packets == NULL ||
+        posix_memalign((void **)&pool->buffers, CACHE_LINE_SIZE,
+                       count * pool->buffer_size) != 0) {
+        perror("packet_pool_init");
+        exit(1);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        pool->packets[i].data = &pool->buffers[i * pool->buffer_size];
+        atomic_init(&pool->packets[i].next,
+                    i + 1 < count ? (packet_handle)(i + 1) : PACKET_NONE);
+    }
+    atomic_init(&pool->free_head, FREE_HEAD(0, count ? 0 : PACKET_NONE));
+    atomic_init(&pool->exhausted, 0);
+}
+
+packet_handle packet_alloc(packet_pool *pool) {
+    uint64_t head = atomic_load_explicit(&pool->free_head,
+                                         memory_order_acquire);
+    while (1) {
+        packet_handle handle = FREE_HEAD_HANDLE(head);
+        if (handle == PACKET_NONE) {
+            atomic_fetch_add_explicit(&pool->exhausted, 1,
+                                      memory_order_relaxed);
+            return PACKET_NONE;
+        }
+
+        packet_handle next = atomic_load_explicit(
+            &pool->packets[handle].next, memory_order_relaxed);
+        uint64_t new_head = FREE_HEAD(FREE_HEAD_TAG(head) + 1, next);
+        if (atomic_compare_exchange_weak_explicit(
+                &pool->free_head, &head, new_head, memory_order_acquire,
+                memory_order_acquire)) {
+            return handle;
+        }
+    }
+}
+
+void packet_free(packet_pool *pool, packet_handle handle) {
+    uint64_t head = atomic_load_explicit(&pool->free_head,
+                                         memory_order_relaxed);
+    while (1) {
+        atomic_store_explicit(&pool->packets[handle].next,
+                              FREE_HEAD_HANDLE(head), memory_order_relaxed);
+        uint64_t new_head = FREE_HEAD(FREE_HEAD_TAG(head) + 1, handle);
+        if (atomic_compare_exchange_weak_explicit(
+                &pool->free_head, &head, new_head, memory_order_release,
+                memory_order_relaxed)) {
+            return;
+        }
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "slip.h"
+
+#define CACHE_LINE_SIZE 64
+
+// Packets are passed between stages as an index into the pool
+typedef uint32_t packet_handle;
+#define PACKET_NONE UINT32_MAX
+
+typedef struct packet {
+    unsigned char *data;
+    int offset;                 // where the IP packet starts in data
+    int length;                 // of the IP packet
+    uint64_t read_time;         // with -T, when it was read (first byte RX)
+    uint64_t ready_time;        // with -T, when RX decode finished
+    uint64_t queued_time;       // with -T, when it was queued for a writer
+    _Atomic packet_handle next; // free list link
+} packet;
+
+// Fixed set of packet buffers allocated up front. The free list is a
+// lock-free stack; its head carries a counter alongside the index so a
+// buffer being freed and reallocated between a load and a compare-exchange
+// can't corrupt it.
+typedef struct packet_pool {
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t free_head;
+    _Alignas(CACHE_LINE_SIZE) atomic_ulong exhausted; // failed allocations
+    packet *packets;
+    unsigned char *buffers;
+    size_t count;
+    size_t buffer_size;
+} packet_pool;
+
+// Every buffer is PACKET_BUFFER_SIZE(mtu), rounded up to whole cache lines so
+// no two buffers share a line.
+void packet_pool_init(packet_pool *pool, size_t count, int mtu);
+
+// Returns PACKET_NONE (and counts it) if every buffer is in use
+packet_handle packet_alloc(packet_pool *pool);
+void packet_free(packet_pool *pool, packet_handle handle);
+
+static inline packet *packet_get(packet_pool *pool, packet_handle handle) {
+    return &pool->packets[handle];
+}
+
+#endif
@@ -0,0 +1,97 @@
+#include "queue.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+void packet_queue_init(packet_queue *queue, size_t depth) {
+    packet_queue_init_shared(queue, depth, dispatch_semaphore_create(0));
+}
+
+void packet_queue_init_shared(packet_queue *queue, size_t depth,
+                              dispatch_semaphore_t ready) {
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    atomic_init(&queue->dropped, 0);
+
+    // One slot is always left empty to tell a full queue from an empty one
+    queue->depth = depth + 1;
+    queue->slots = calloc(queue->depth, sizeof(packet_handle));
+    if (queue->slots == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+
+    queue->ready = ready;
+}
+
+int packet_queue_push(packet_queue *queue, packet_handle handle) {
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+
+    if ((tail + 1) % queue->depth == head) {
+        atomic_fetch_add_explicit(&queue->dropped, 1, memory_order_relaxed);
+        return -1;
+    }
+
+    queue->slots[tail] = handle;
+    atomic_store_explicit(&queue->tail, (tail + 1) % queue->depth,
+                          memory_order_release);
+    dispatch_semaphore_signal(queue->ready);
+    return 0;
+}
+
+int packet_queue_wait(dispatch_semaphore_t ready, int64_t timeout_us) {
+    dispatch_time_t timeout;
+    if (timeout_us < 0) {
+        timeout = DISPATCH_TIME_FOREVER;
+    } else if (timeout_us == 0) {
+        timeout = DISPATCH_TIME_NOW;
+    } else {
+        timeout = dispatch_time(DISPATCH_TIME_NOW, timeout_us * NSEC_PER_USEC);
+    }
+
+    return dispatch_semaphore_wait(ready, timeout) == 0 ? 0 : -1;
+}
+
+packet_handle packet_queue_pop(packet_queue *queue, int64_t timeout_us) {
+    if (packet_queue_wait(queue->ready, timeout_us) == -1) {
+        return PACKET_NONE;
+    }
+
+    // The semaphore says a packet has been queued. Loading tail with acquire
+    // pairs with the release in packet_queue_push() so the slot (and the
+    // packet it refers to) is visible here; it's already past head by now so
+    // this doesn't actually spin.
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    while (atomic_load_explicit(&queue->tail, memory_order_acquire) == head) {
+    }
+
+    packet_handle handle = queue->slots[head];
+    atomic_store_explicit(&queue->head, (head + 1) % queue->depth,
+                          memory_order_release);
+    return handle;
+}
+
+packet_handle packet_queue_peek(packet_queue *queue) {
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    if (atomic_load_explicit(&queue->tail, memory_order_acquire) == head) {
+        return PACKET_NONE;
+    }
+    return queue->slots[head];
+}
+
+packet_handle packet_queue_try_pop(packet_queue *queue) {
+    packet_handle handle = packet_queue_peek(queue);
+    if (handle != PACKET_NONE) {
+        size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+        atomic_store_explicit(&queue->head, (head + 1) % queue->depth,
+                              memory_order_release);
+    }
+    return handle;
+}
+
+size_t packet_queue_length(packet_queue *queue) {
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    return (tail + queue->depth - head) % queue->depth;
+}
@@ -0,0 +1,52 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <dispatch/dispatch.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pool.h"
+
+#define DEFAULT_QUEUE_DEPTH 64
+
+// Bounded single producer, single consumer queue of packet handles. Neither
+// side ever takes a lock. The semaphore only lets the consumer sleep while
+// the queue is empty.
+typedef struct packet_queue {
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t head; // only written by consumer
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t tail; // only written by producer
+    _Alignas(CACHE_LINE_SIZE) atomic_ulong dropped;
+    size_t depth;
+    packet_handle *slots;
+    dispatch_semaphore_t ready; // counts queued packets
+} packet_queue;
+
+void packet_queue_init(packet_queue *queue, size_t depth);
+
+// As packet_queue_init(), but pushes signal ready, which may be shared
+// between several queues with the same consumer. The consumer then waits on
+// it and takes packets with packet_queue_try_pop() rather than
+// packet_queue_pop().
+void packet_queue_init_shared(packet_queue *queue, size_t depth,
+                              dispatch_semaphore_t ready);
+
+// Producer side. Returns -1 (and counts a drop) if the queue is full, in
+// which case the packet still belongs to the caller.
+int packet_queue_push(packet_queue *queue, packet_handle handle);
+
+// Consumer side. Waits up to timeout_us (-1 for ever, 0 to not wait at all)
+// for a packet. Returns PACKET_NONE on timeout.
+packet_handle packet_queue_pop(packet_queue *queue, int64_t timeout_us);
+
+// Waits for ready as packet_queue_pop() does. Returns -1 on timeout.
+int packet_queue_wait(dispatch_semaphore_t ready, int64_t timeout_us);
+
+// Consumer side, for queues sharing a semaphore. Return PACKET_NONE if the
+// queue is empty, without waiting. peek leaves the packet queued.
+packet_handle packet_queue_peek(packet_queue *queue);
+packet_handle packet_queue_try_pop(packet_queue *queue);
+
+size_t packet_queue_length(packet_queue *queue);
+
+#endif
@@ -0,0 +1,76 @@
+#include "realtime.h"
+
+#include <mach/mach.h>
+#include <mach/mach_error.h>
+#include <mach/mach_time.h>
+#include <mach/thread_policy.h>
+#include <pthread.h>
+#include <pthread/qos.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "slip.h"
+
+// Time constraint parameters. The threads wake for each packet rather than
+// on a period, and a packet (or a batch) takes well under computation to
+// handle. If a thread runs for longer than that the kernel demotes it, so a
+// runaway can't starve the machine.
+#define REALTIME_COMPUTATION_NS 200000
+#define REALTIME_CONSTRAINT_NS 1000000
+
+int priority_parse(const char *name) {
+    if (strcmp(name, "interactive") == 0) {
+        return PRIORITY_INTERACTIVE;
+    } else if (strcmp(name, "realtime") == 0) {
+        return PRIORITY_REALTIME;
+    }
+    return -1;
+}
+
+static uint32_t ns_to_abs(uint64_t ns) {
+    mach_timebase_info_data_t timebase;
+    mach_timebase_info(&timebase);
+    return (uint32_t)(ns * timebase.denom / timebase.numer);
+}
+
+void set_thread_priority(int priority, int affinity_tag) {
+    thread_act_t thread = pthread_mach_thread_np(pthread_self());
+
+    if (priority == PRIORITY_INTERACTIVE) {
+        int error =
+            pthread_set_qos_class_self_np(QOS_CLASS_USER_INTERACTIVE, 0);
+        if (error != 0) {
+            fprintf(stderr, "Unable to set thread QoS: %s\n", strerror(error));
+        }
+    } else if (priority == PRIORITY_REALTIME) {
+        thread_time_constraint_policy_data_t policy;
+        policy.period = 0;
+        policy.computation = ns_to_abs(REALTIME_COMPUTATION_NS);
+        policy.constraint = ns_to_abs(REALTIME_CONSTRAINT_NS);
+        policy.preemptible = 1;
+        kern_return_t result = thread_policy_set(
+            thread, THREAD_TIME_CONSTRAINT_POLICY, (thread_policy_t)&policy,
+            THREAD_TIME_CONSTRAINT_POLICY_COUNT);
+        if (result != KERN_SUCCESS) {
+            fprintf(stderr, "Unable to set time constraint policy: %s\n",
+                    mach_error_string(result));
+        }
+    }
+
+    if (affinity_tag != THREAD_AFFINITY_TAG_NULL) {
+        // Only a hint, and Apple Silicon ignores it altogether
+        thread_affinity_policy_data_t policy = {affinity_tag};
+        thread_policy_set(thread, THREAD_AFFINITY_POLICY,
+                          (thread_policy_t)&policy,
+                          THREAD_AFFINITY_POLICY_COUNT);
+    }
+}
+
+void forwarding_thread_started(slip_link *link, int direction) {
+    if (link->priority == PRIORITY_DEFAULT && !link->affinity) {
+        return;
+    }
+    int tag = link->affinity ? link->utun_num * 2 + 1 + direction
+                             : THREAD_AFFINITY_TAG_NULL;
+    set_thread_priority(link->priority, tag);
+}
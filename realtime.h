@@ -0,0 +1,31 @@
+#ifndef REALTIME_H
+#define REALTIME_H
+
+// How the forwarding threads are scheduled (-y). By default they are
+// ordinary threads, so on a loaded machine a packet can wait for a core as
+// long as the kernel likes.
+#define PRIORITY_DEFAULT 0
+#define PRIORITY_INTERACTIVE 1 // QOS_CLASS_USER_INTERACTIVE
+#define PRIORITY_REALTIME 2    // Mach time constraint policy
+
+// Each forwarding thread handles one direction
+#define THREAD_TX 0
+#define THREAD_RX 1
+
+// name is "interactive" or "realtime". Returns -1 for an unknown name.
+int priority_parse(const char *name);
+
+struct slip_link;
+
+// Applies priority to the calling thread. affinity_tag, if not 0, asks the
+// kernel to keep threads with the same tag on cores sharing an L2 cache, and
+// threads with different tags apart. Failures are reported but not fatal.
+void set_thread_priority(int priority, int affinity_tag);
+
+// Applies link's -y and -a settings to the calling thread, which forwards
+// packets for it in direction. The two directions of a link get different
+// affinity tags, so they don't compete for one L2, while the reader and
+// writer of each direction, which hand packets to each other, share one.
+void forwarding_thread_started(struct slip_link *link, int direction);
+
+#endif
@@ -0,0 +1,127 @@
+#include "scheduler.h"
+
+#include <netinet/in.h>
+
+void tx_scheduler_init(tx_scheduler *scheduler, char type, size_t depth,
+                       packet_pool *pool, int mtu) {
+    scheduler->classes = type == SCHEDULER_PRIORITY ? TX_CLASSES : 1;
+    scheduler->ready = dispatch_semaphore_create(0);
+    scheduler->pool = pool;
+
+    // Every class can send at least one full frame per round, interactive
+    // traffic twice as much as the others
+    for (int i = 0; i < scheduler->classes; i++) {
+        packet_queue_init_shared(&scheduler->queues[i], depth,
+                                 scheduler->ready);
+        scheduler->quantum[i] = MAX_FRAME_SIZE(mtu);
+        scheduler->deficit[i] = 0;
+    }
+    scheduler->quantum[TX_CLASS_INTERACTIVE] *= 2;
+}
+
+static int dscp_class(int tos) {
+    int dscp = tos >> 2;
+
+    if (dscp == 46 || dscp >= 48 || (dscp >= 32 && dscp < 40)) {
+        // EF, network control and CS4/AF4x (interactive video, gaming)
+        return TX_CLASS_INTERACTIVE;
+    } else if (dscp == 8) {
+        // CS1, lower effort
+        return TX_CLASS_BULK;
+    } else if (dscp == 0 && (tos & 0x10)) {
+        // RFC 1349 low delay, still set by ssh and others
+        return TX_CLASS_INTERACTIVE;
+    } else if (dscp == 0 && (tos & 0x08)) {
+        // RFC 1349 high throughput, e.g. scp and ftp-data
+        return TX_CLASS_BULK;
+    }
+    return TX_CLASS_DEFAULT;
+}
+
+static int classify(const unsigned char *ip, int length) {
+    int tos, protocol, header_length;
+
+    if (length >= 20 && (ip[0] >> 4) == 4) {
+        tos = ip[1];
+        protocol = ip[9];
+        header_length = (ip[0] & 0x0f) * 4;
+    } else if (length >= 40 && (ip[0] >> 4) == 6) {
+        tos = (ip[0] & 0x0f) << 4 | ip[1] >> 4;
+        protocol = ip[6];
+        header_length = 40;
+    } else {
+        return TX_CLASS_DEFAULT;
+    }
+
+    int dscp = dscp_class(tos);
+    if (dscp != TX_CLASS_DEFAULT) {
+        return dscp;
+    }
+
+    if (length <= INTERACTIVE_MAX_SIZE || protocol == IPPROTO_ICMP ||
+        protocol == IPPROTO_ICMPV6) {
+        return TX_CLASS_INTERACTIVE;
+    }
+
+    if ((protocol == IPPROTO_TCP || protocol == IPPROTO_UDP) &&
+        length >= header_length + 4) {
+        int src = ip[header_length] << 8 | ip[header_length + 1];
+        int dst = ip[header_length + 2] << 8 | ip[header_length + 3];
+        if (src == 53 || dst == 53 || src == 123 || dst == 123) {
+            // DNS and NTP, which suffers from any queueing delay
+            return TX_CLASS_INTERACTIVE;
+        }
+    }
+    return TX_CLASS_DEFAULT;
+}
+
+int tx_scheduler_push(tx_scheduler *scheduler, packet_handle handle) {
+    int class = 0;
+    if (scheduler->classes > 1) {
+        packet *p = packet_get(scheduler->pool, handle);
+        class = classify(&p->data[p->offset], p->length);
+    }
+    return packet_queue_push(&scheduler->queues[class], handle);
+}
+
+packet_handle tx_scheduler_pop(tx_scheduler *scheduler, int64_t timeout_us) {
+    if (packet_queue_wait(scheduler->ready, timeout_us) == -1) {
+        return PACKET_NONE;
+    }
+
+    // Something has been queued, so this always finds it
+    while (1) {
+        for (int i = 0; i < scheduler->classes; i++) {
+            packet_handle handle = packet_queue_peek(&scheduler->queues[i]);
+            if (handle == PACKET_NONE) {
+                continue;
+            }
+
+            if (scheduler->classes > 1) {
+                int length = packet_get(scheduler->pool, handle)->length;
+                if (length > scheduler->deficit[i]) {
+                    continue;
+                }
+                scheduler->deficit[i] -= length;
+            }
+            return packet_queue_try_pop(&scheduler->queues[i]);
+        }
+
+        // Every class with packets waiting has used its share, start a new
+        // round. Only classes with a backlog carry over what they didn't use.
+        for (int i = 0; i < scheduler->classes; i++) {
+            if (packet_queue_peek(&scheduler->queues[i]) == PACKET_NONE) {
+                scheduler->deficit[i] = 0;
+            }
+            scheduler->deficit[i] += scheduler->quantum[i];
+        }
+    }
+}
+
+unsigned long tx_scheduler_dropped(tx_scheduler *scheduler) {
+    unsigned long dropped = 0;
+    for (int i = 0; i < scheduler->classes; i++) {
+        dropped += atomic_load(&scheduler->queues[i].dropped);
+    }
+    return dropped;
+}
@@ -0,0 +1,55 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <dispatch/dispatch.h>
+#include <stdint.h>
+
+#include "pool.h"
+#include "queue.h"
+
+// TX scheduling between the utun reader and the serial writer. With one
+// class this is a plain FIFO. With priority scheduling packets are sorted
+// into classes and each class gets its own queue, so a keystroke doesn't wait
+// behind a queue full of bulk transfer.
+//
+// Classes are served with deficit round robin: each round a class may send
+// up to its quantum of bytes, and within a round higher classes go first.
+// Bulk always gets its quantum each round so it is never starved.
+
+#define TX_CLASS_INTERACTIVE 0
+#define TX_CLASS_DEFAULT 1
+#define TX_CLASS_BULK 2
+#define TX_CLASSES 3
+
+#define SCHEDULER_FIFO 'f'
+#define SCHEDULER_PRIORITY 'p'
+
+// Packets this small go in the interactive class whatever else they are.
+// Covers keystrokes, TCP ACKs and most DNS queries.
+#define INTERACTIVE_MAX_SIZE 128
+
+typedef struct tx_scheduler {
+    int classes; // 1 for FIFO
+    packet_queue queues[TX_CLASSES];
+    dispatch_semaphore_t ready; // counts packets queued in all classes
+
+    // Consumer only
+    packet_pool *pool;
+    int quantum[TX_CLASSES];
+    int deficit[TX_CLASSES];
+} tx_scheduler;
+
+void tx_scheduler_init(tx_scheduler *scheduler, char type, size_t depth,
+                       packet_pool *pool, int mtu);
+
+// Producer side. Returns -1 (and counts a drop) if the packet's queue is
+// full, in which case the packet still belongs to the caller.
+int tx_scheduler_push(tx_scheduler *scheduler, packet_handle handle);
+
+// Consumer side. Waits like packet_queue_pop().
+packet_handle tx_scheduler_pop(tx_scheduler *scheduler, int64_t timeout_us);
+
+// Total dropped across all classes
+unsigned long tx_scheduler_dropped(tx_scheduler *scheduler);
+
+#endif
@@ -1,48 +1,67 @@
+#include <arpa/inet.h>
 #include <errno.h>
+#include <IOKit/serial/ioss.h>
 #include <fcntl.h>
+#include <net/if.h>
 #include <net/if_utun.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netinet6/in6_var.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/select.h>
 #include <sys/kern_control.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/sys_domain.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <syslog.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
-#define DEVICE_TYPE_HARDWARE 'h'
-#define DEVICE_TYPE_SOCKET_CLIENT 'c'
-#define DEVICE_TYPE_SOCKET_SERVER 's'
-#define DEFAULT_BAUD 9600
-
-#define MAX_UTUN_NUMBER 255
+#include "bond.h"
+#include "capture.h"
+#include "codec.h"
+#include "compress.h"
+#include "config.h"
+#include "crc.h"
+#include "datagram.h"
+#include "filter.h"
+#include "queue.h"
+#include "realtime.h"
+#include "scheduler.h"
+#include "slip.h"
+#include "timing.h"
+#include "vj.h"
 
-#define MTU 1500
-#define NULL_LOOPBACK_HEADER_SIZE 4
-#define MAX_PACKET_SIZE (MTU + NULL_LOOPBACK_HEADER_SIZE)
-#define MAX_PACKET_SIZE_SLIP                                                   \
-    (MTU * 2 + 1) // worst case all escaped plus the end character
+#define DEFAULT_BAUD 9600
 
-#define END 0xc0
-#define ESC 0xdb
-#define ESC_ESC 0xdd
-#define ESC_END 0xdc
+#ifndef ND6_INFINITE_LIFETIME
+#define ND6_INFINITE_LIFETIME 0xffffffff
+#endif
 
-#define DECODE_END_OF_PACKET -2
+// Reconnect attempts back off exponentially between these
+#define RECONNECT_MIN_DELAY_MS 100
+#define RECONNECT_MAX_DELAY_MS 5000
 
-// #define DEBUG
+// How long a reconnect waits for a TX write to the old device to give up
+#define WRITER_TIMEOUT_MS 1000
 
-int open_serial_port(const char *device, uint32_t baud_rate) {
+int open_serial_port(slip_link *link) {
     // From: https://www.pololu.com/docs/0J73/15.5
     // Opens the specified serial port, sets it up for binary communication,
     // configures its read timeouts, and sets its baud rate.
     // Returns a non-negative file descriptor on success, or -1 on failure.
+    const char *device = link->device_path;
+    uint32_t baud_rate = link->baud;
     int fd = open(device, O_RDWR | O_NOCTTY);
     if (fd == -1) {
         perror(device);
@@ -70,13 +89,25 @@ int open_serial_port(const char *device, uint32_t baud_rate) {
     options.c_oflag &= ~(ONLCR | OCRNL);
     options.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
 
-    // Set up timeouts: Calls to read() will return as soon as there is
-    // at least one byte available or when 100 ms has passed.
-    // options.c_cc[VTIME] = 0;//1;
-    // options.c_cc[VMIN] = 0;
+    // Set up timeouts: Calls to read() return once vmin bytes have arrived,
+    // or once there is at least one and nothing more has come for vtime
+    // tenths of a second. With the block decoder a bigger vmin means fewer,
+    // larger reads for a little latency. Non-blocking reads (-e kqueue)
+    // ignore both.
+    options.c_cc[VMIN] = link->vmin;
+    options.c_cc[VTIME] = link->vtime;
+
+    // RTS/CTS, so either end can hold the other off rather than overrun it
+    if (link->flow_control) {
+        options.c_cflag |= CRTSCTS;
+    } else {
+        options.c_cflag &= ~CRTSCTS;
+    }
 
-    // This code only supports certain standard baud rates. Supporting
-    // non-standard baud rates should be possible but takes more work.
+    // Standard baud rates can be set through termios. Anything else (the
+    // fast rates USB adapters support, or odd ones) is set afterwards with
+    // IOSSIOSPEED, leaving termios at a standard rate in the meantime.
+    int standard = 1;
     switch (baud_rate) {
     case 4800:
         cfsetospeed(&options, B4800);
@@ -90,12 +121,17 @@ int open_serial_port(const char *device, uint32_t baud_rate) {
     case 38400:
         cfsetospeed(&options, B38400);
         break;
+    case 57600:
+        cfsetospeed(&options, B57600);
+        break;
     case 115200:
         cfsetospeed(&options, B115200);
         break;
+    case 230400:
+        cfsetospeed(&options, B230400);
+        break;
     default:
-        fprintf(stderr, "warning: baud rate %u is not supported, using 9600.\n",
-                baud_rate);
+        standard = 0;
         cfsetospeed(&options, B9600);
         break;
     }
@@ -108,6 +144,28 @@ int open_serial_port(const char *device, uint32_t baud_rate) {
         return -1;
     }
 
+    // Must come after tcsetattr(), which would put the speed back
+    if (!standard) {
+        speed_t speed = baud_rate;
+        if (ioctl(fd, IOSSIOSPEED, &speed) == -1) {
+            fprintf(stderr, "baud rate %u is not supported by %s: %s\n",
+                    baud_rate, device, strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+
+    // How long the driver may sit on received bytes before handing them
+    // over. USB adapters otherwise wait for their own latency timer (16 ms
+    // on FTDI) or a full packet. Not fatal, not every driver supports it.
+    if (link->data_latency_us > 0) {
+        unsigned long latency = link->data_latency_us;
+        if (ioctl(fd, IOSSDATALAT, &latency) == -1) {
+            fprintf(stderr, "Unable to set %s data latency: %s\n", device,
+                    strerror(errno));
+        }
+    }
+
     return fd;
 }
 
@@ -143,13 +201,15 @@ int open_unix_domain_socket_as_client(const char *socket_path,
     return fd;
 }
 
-int open_unix_domain_socket_as_server(const char *socket_path) {
+int open_unix_domain_socket_as_server(const char *socket_path, int type) {
     // From: https://troydhanson.github.io/network/Unix_domain_sockets.html
+    // This only creates the listening socket. It's kept open for as long as
+    // we run and every reconnect accepts a new client on it.
 
-    int fd, cl;
+    int fd;
     struct sockaddr_un addr;
 
-    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+    if ((fd = socket(AF_UNIX, type, 0)) == -1) {
         perror("socket error");
         exit(-1);
     }
@@ -174,7 +234,7 @@ int open_unix_domain_socket_as_server(const char *socket_path) {
         exit(-1);
     }
 
-    if (listen(fd, 5) == -1) {
+    if (type == SOCK_STREAM && listen(fd, 5) == -1) {
         perror("listen error");
         exit(-1);
     }
@@ -182,17 +242,79 @@ int open_unix_domain_socket_as_server(const char *socket_path) {
     // Put umask back just in case
     umask(orig_umask);
 
-    printf("Socket opened, waiting for client connect...\n");
+    return fd;
+}
 
-    if ((cl = accept(fd, NULL, NULL)) == -1) {
-        perror("accept error");
+// Connects to address, given as host:port or [host]:port, with a socket of
+// type (SOCK_STREAM for TCP or SOCK_DGRAM for UDP). The host is looked up
+// again each time, in case it has moved.
+int open_inet_socket(const char *address, int type, int error_is_fatal) {
+    char host[256];
+    const char *port = strrchr(address, ':');
+    if (port == NULL || port == address) {
+        fprintf(stderr, "%s should be host:port\n", address);
+        exit(EXIT_FAILURE);
+    }
+    int host_length = port - address;
+    if (address[0] == '[' && port[-1] == ']') {
+        address++;
+        host_length -= 2;
+    }
+    snprintf(host, sizeof(host), "%.*s", host_length, address);
+    port++;
+
+    struct addrinfo hints, *addresses;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = type;
+    int error = getaddrinfo(host, port, &hints, &addresses);
+    if (error) {
+        if (error_is_fatal) {
+            fprintf(stderr, "%s: %s\n", host, gai_strerror(error));
+        }
         return -1;
     }
 
-    return cl;
+    int fd = -1;
+    for (struct addrinfo *a = addresses; a && fd == -1; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd == -1) {
+            continue;
+        }
+        if (connect(fd, a->ai_addr, a->ai_addrlen) == -1) {
+            if (error_is_fatal) {
+                perror("connect error");
+            }
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    if (fd == -1 || type != SOCK_STREAM) {
+        return fd;
+    }
+
+    // Frames are written whole, so Nagle would only hold them up. Keepalives
+    // notice a serial server that has gone away without closing.
+    int on = 1;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) == -1 ||
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) == -1) {
+        perror("setsockopt");
+    }
+    return fd;
 }
 
-int tun(int number) {
+int accept_unix_domain_socket_client(int listenfd) {
+    printf("Socket opened, waiting for client connect...\n");
+
+    int fd = accept(listenfd, NULL, NULL);
+    if (fd == -1) {
+        perror("accept error");
+    }
+    return fd;
+}
+
+int tun(void) {
     // Original header:
     // From http://newosxbook.com/src.jl?tree=listings&file=17-15-utun.c
     //   via
@@ -231,16 +353,12 @@ int tun(int number) {
     sc.sc_len = sizeof(sc);
     sc.sc_family = AF_SYSTEM;
     sc.ss_sysaddr = AF_SYS_CONTROL;
-    sc.sc_unit = number + 1;
-
-    // If the connect is successful, a tun%d device will be created, where "%d"
-    // is our unit number -1
+    // Unit 0 lets the kernel pick the first free utun, rather than us
+    // trying each in turn until one isn't in use
+    sc.sc_unit = 0;
 
     if (connect(fd, (struct sockaddr *)&sc, sizeof(sc)) == -1) {
-        // Note if the utun is already in use this check will be hit,
-        // we don't log this as it's not an isue, we can try another
-        // one
-        // perror ("connect(AF_SYS_CONTROL)");
+        perror("connect(AF_SYS_CONTROL)");
         close(fd);
         return -1;
     }
@@ -248,310 +366,1451 @@ int tun(int number) {
     return fd;
 }
 
-int encode_slip(unsigned char *in, unsigned char *out, int length) {
-    int count = 0;
-    int i;
-
-    for (i = 0; i < length; i++) {
-        unsigned char c = *in;
-        if (c == END) {
-            *out = ESC;
-            out++;
-            *out = ESC_END;
-            count++;
-        } else if (c == ESC) {
-            *out = ESC;
-            out++;
-            *out = ESC_ESC;
-            count++;
-        } else {
-            *out = c;
-        }
+int batch_time_left_us(struct timespec *start, int latency_us) {
+    // How much longer a batch started at start may wait for more packets
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-        in++;
-        out++;
-        count++;
+    long elapsed_us = (now.tv_sec - start->tv_sec) * 1000000L +
+                      (now.tv_nsec - start->tv_nsec) / 1000;
+    if (elapsed_us >= latency_us) {
+        return 0;
     }
-
-    *out = END;
-    count++;
-
-    return count;
+    return latency_us - elapsed_us;
 }
 
-int decode_slip(int fd) {
-    unsigned char c;
-    if (!read(fd, &c, 1)) {
-        printf("Read error\n");
-        return -1;
+void set_socket_buffers(int fd, int size, const char *what) {
+    // Not fatal, the kernel may cap it (kern.ipc.maxsockbuf) or not allow it
+    // on this kind of socket
+    if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) == -1 ||
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) == -1) {
+        fprintf(stderr, "Unable to set %s buffers to %i bytes: %s\n", what,
+                size, strerror(errno));
     }
+}
 
-    if (c == ESC) {
-        // escape character - look at the next one too
-        if (!read(fd, &c, 1)) {
-            printf("Read error\n");
+// Writes all of iov to the device. A socket or tty may take only part of a
+// write, in which case the rest is written after it (and counted) rather
+// than lost, which would corrupt the frame. Returns -1 on error.
+static ssize_t write_all(slip_link *args, struct iovec *iov, int iovcnt) {
+    ssize_t total = 0;
+
+    while (iovcnt > 0) {
+        ssize_t n = writev(args->serialfd, iov, iovcnt);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n == -1) {
+            STAT_ADD(args->stats.tx_write_errors, 1);
             return -1;
         }
-        if (c == ESC_END) {
-            return END;
-        } else if (c == ESC_ESC) {
-            return ESC;
-        } else {
-            printf("Decoding error\n");
-            return -1;
+        total += n;
+        STAT_ADD(args->stats.tx_wire_bytes, n);
+
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
         }
-    } else if (c == END) {
-        return DECODE_END_OF_PACKET;
-    } else {
-        return c;
+        if (iovcnt > 0) {
+            STAT_ADD(args->stats.tx_short_writes, 1);
+            iov->iov_base = (unsigned char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return total;
+}
+
+// The TX writer claims the device for each write, so a reconnect never
+// closes the fd (which may then be reused for something else) while it is
+// being written to. Returns 0, without claiming it, if the device is down.
+static int claim_device(slip_link *link) {
+    atomic_store(&link->tx_writing, 1);
+    if (!atomic_load(&link->device_up)) {
+        atomic_store(&link->tx_writing, 0);
+        return 0;
+    }
+    return 1;
+}
+
+static void release_device(slip_link *link) {
+    atomic_store(&link->tx_writing, 0);
+}
+
+void write_packet(slip_link *args, unsigned char *ip, int len,
+                  unsigned char *encoded) {
+    // encoded must have room for MAX_PACKET_SIZE_SLIP(mtu) bytes
+    struct iovec iov[SLIP_MAX_IOV];
+    int iovcnt;
+
+    if (!claim_device(args)) {
+        STAT_ADD(args->stats.tx_outage_dropped, 1);
+        return;
+    }
+
+    if (IS_DATAGRAM(args->device_type)) {
+        // A reconnect is noticed by the reader
+        datagram_send(args, ip, len);
+        release_device(args);
+        return;
     }
+
+    // Usually there is little or nothing to escape, so the packet can be
+    // written without copying it. Otherwise encode it into a buffer.
+    iovcnt = encode_slip_iov(ip, len, iov, SLIP_MAX_IOV);
+    if (iovcnt == -1) {
+        iov[0].iov_base = encoded;
+        iov[0].iov_len = encode_slip(ip, encoded, len);
+        iovcnt = 1;
+    }
+
+    write_all(args, iov, iovcnt);
+    release_device(args);
 }
 
-int next_slip_packet(int fd, unsigned char buf[MTU]) {
-    int i = 0;
+void *tx_writer_thread(void *vargp) {
+    slip_link *args = (slip_link *)vargp;
+
+    // With batching, everything already queued is encoded into one buffer
+    // and sent with one write(), rather than one write() (and one USB
+    // transfer) per packet. There is room for one more worst case packet past
+    // the limit, so a packet is never split across batches.
+    unsigned char *batch = NULL;
+    if (args->batch_bytes > 0) {
+        batch = malloc(args->batch_bytes + MAX_PACKET_SIZE_SLIP(args->mtu));
+    } else {
+        batch = malloc(MAX_PACKET_SIZE_SLIP(args->mtu));
+    }
+    if (batch == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    link_timing *timing = args->timing;
+    forwarding_thread_started(args, THREAD_TX);
+
     while (1) {
-        int result = decode_slip(fd);
-        if (result == -1) {
-            return -1;
-        } else if (result == DECODE_END_OF_PACKET) {
-            // full packet
-            return i;
+        packet_handle h = PACKET_NONE;
+        int slept = 0;
+        if (timing) {
+            // Only a wait that found the queue empty measures how long
+            // this thread took to be scheduled
+            h = tx_scheduler_pop(args->tx_queue, 0);
+            slept = h == PACKET_NONE;
+        }
+        if (h == PACKET_NONE) {
+            h = tx_scheduler_pop(args->tx_queue, -1);
+        }
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int used = 0;
+        int batched = 0;
+        uint64_t oldest = 0;
+
+        while (h != PACKET_NONE) {
+            // The packet is encoded straight out of its pool buffer
+            packet *p = packet_get(args->pool, h);
+            unsigned char *ip = &p->data[p->offset];
+            uint64_t dequeued = 0;
+            if (timing) {
+                dequeued = timing_now();
+                histogram_record(&timing->tx_queue, p->read_time, dequeued);
+                if (slept) {
+                    histogram_record(&timing->tx_wakeup, p->queued_time,
+                                     dequeued);
+                    slept = 0;
+                }
+                if (used == 0) {
+                    oldest = p->read_time;
+                }
+            }
+
+            int len = -1;
+            if (!atomic_load_explicit(&args->device_up,
+                                      memory_order_relaxed)) {
+                // Nobody to send it to, and by the time there is it would
+                // only be a stale retransmit getting in the way
+                STAT_ADD(args->stats.tx_outage_dropped, 1);
+            } else {
+                len = tx_stages(args, &ip, p->length);
+                if (len < 1) {
+                    STAT_ADD(args->stats.tx_stage_dropped, 1);
+                } else {
+                    len = add_frame_check(args, ip, len);
+                    STAT_ADD(args->stats.tx_frame_bytes, len);
+                }
+            }
+
+            if (len > 0 && args->batch_bytes <= 0) {
+                uint64_t encoded = 0;
+                if (timing) {
+                    encoded = timing_now();
+                    histogram_record(&timing->tx_encode, dequeued, encoded);
+                }
+                write_packet(args, ip, len, batch);
+                if (timing) {
+                    uint64_t written = timing_now();
+                    histogram_record(&timing->tx_write, encoded, written);
+                    histogram_record(&timing->tx_total, p->read_time,
+                                     written);
+                }
+            } else if (len > 0) {
+                used += encode_slip(ip, &batch[used], len);
+                batched++;
+                if (timing) {
+                    histogram_record(&timing->tx_encode, dequeued,
+                                     timing_now());
+                }
+            }
+            if (timing) {
+                // For a batch the interval ends here, as the buffer may be
+                // reused before the write
+                signpost_tx_end(p);
+            }
+            packet_free(args->pool, h);
+
+            if (used >= args->batch_bytes) {
+                break;
+            }
+
+            // Take whatever else is queued, waiting up to the latency cap
+            h = tx_scheduler_pop(
+                args->tx_queue,
+                batch_time_left_us(&start, args->batch_latency_us));
+        }
+
+        if (used == 0) {
+            continue;
+        }
+
+        uint64_t write_start = timing ? timing_now() : 0;
+        struct iovec iov = {batch, used};
+        if (claim_device(args)) {
+            write_all(args, &iov, 1);
+            release_device(args);
         } else {
-            buf[i] = (unsigned char)result;
-            i++;
+            STAT_ADD(args->stats.tx_outage_dropped, batched);
+        }
+        if (timing) {
+            uint64_t written = timing_now();
+            histogram_record(&timing->tx_write, write_start, written);
+            histogram_record(&timing->tx_total, oldest, written);
         }
     }
+    return vargp;
 }
 
-typedef struct thread_args {
-    int utunfd;
-    int serialfd;
-} thread_args;
-
 void *tx_thread(void *vargp) {
-    thread_args *args = (thread_args *)vargp;
+    slip_link *args = (slip_link *)vargp;
+    int size = MAX_PACKET_SIZE(args->mtu);
+    unsigned char *discard = malloc(size);
+    if (discard == NULL) {
+        perror("malloc");
+        exit(1);
+    }
 
-    // Read from tunnel and forward it to serial
-    while (1) {
-        unsigned char c[MAX_PACKET_SIZE];
-        unsigned char encoded[MAX_PACKET_SIZE_SLIP];
-        int len;
-        int i;
-        int encoded_length;
+    forwarding_thread_started(args, THREAD_TX);
 
-        len = read(args->utunfd, c, MAX_PACKET_SIZE);
+    // Read from tunnel and queue it for the serial writer. This keeps
+    // draining the kernel while the writer is blocked on a slow device.
+    while (1) {
+        packet_handle h = packet_alloc(args->pool);
+        // The first 4 bytes read are the null/loopback header, which goes in
+        // front of the headroom. Out of buffers, the packet still has to be
+        // read to drop it.
+        unsigned char *buf =
+            h != PACKET_NONE ? &packet_get(args->pool, h)
+                                    ->data[PACKET_HEADROOM -
+                                           NULL_LOOPBACK_HEADER_SIZE]
+                             : discard;
+
+        int len = read(args->utunfd, buf, size);
 
         if (len == -1) {
             printf("error %i\n", errno);
             return vargp;
+        } else if (h == PACKET_NONE) {
+            continue;
         }
 
-        // Skip first 4 bytes - this is the null/loopback header
-        len -= 4;
-        unsigned char packet[MTU];
-        memcpy(packet, &c[4], len);
+        len = remove_loopback_header(args, buf, len);
+        if (len == -1 ||
+            (args->filter &&
+             filter_packet(args->filter, &buf[NULL_LOOPBACK_HEADER_SIZE],
+                           len) == FILTER_DROP)) {
+            packet_free(args->pool, h);
+            continue;
+        }
+
+        packet *p = packet_get(args->pool, h);
+        p->offset = PACKET_HEADROOM;
+        p->length = len;
+        if (args->capture) {
+            capture_packet(args->capture, CAPTURE_TX, &p->data[p->offset],
+                           len);
+        }
+        if (args->timing) {
+            p->read_time = timing_now();
+            p->queued_time = p->read_time;
+            signpost_tx_begin(p);
+        }
+        if (tx_scheduler_push(args->tx_queue, h) == -1) {
+            if (args->timing) {
+                signpost_tx_end(p);
+            }
+            packet_free(args->pool, h);
+            continue;
+        }
+        STAT_ADD(args->stats.tx_packets, 1);
+        STAT_ADD(args->stats.tx_bytes, len);
+    }
+    return vargp;
+}
 
-        encoded_length = encode_slip(packet, encoded, len);
+void *rx_writer_thread(void *vargp) {
+    slip_link *args = (slip_link *)vargp;
+    forwarding_thread_started(args, THREAD_RX);
 
-#ifdef DEBUG
-        printf("TX:\n");
-        for (i = 0; i < encoded_length; i++) {
-            printf("%02x ", encoded[i]);
-            if ((i - 4) % 16 == 15)
-                printf("\n");
+    while (1) {
+        packet_handle h = PACKET_NONE;
+        int slept = 0;
+        if (args->timing) {
+            h = packet_queue_pop(args->rx_queue, 0);
+            slept = h == PACKET_NONE;
         }
-        printf("\n");
-#endif
+        if (h == PACKET_NONE) {
+            h = packet_queue_pop(args->rx_queue, -1);
+        }
+        packet *p = packet_get(args->pool, h);
+
+        unsigned char *frame = &p->data[p->offset];
+        int length = add_loopback_header(&frame, p->length);
 
-        write(args->serialfd, encoded, encoded_length);
+        uint64_t dequeued = args->timing ? timing_now() : 0;
+        if (write(args->utunfd, frame, length) == -1) {
+            STAT_ADD(args->stats.rx_write_errors, 1);
+        } else {
+            STAT_ADD(args->stats.rx_packets, 1);
+            STAT_ADD(args->stats.rx_bytes, p->length);
+        }
+        if (args->timing) {
+            link_timing *timing = args->timing;
+            uint64_t written = timing_now();
+            histogram_record(&timing->rx_queue, p->ready_time, dequeued);
+            if (slept) {
+                histogram_record(&timing->rx_wakeup, p->queued_time,
+                                 dequeued);
+            }
+            histogram_record(&timing->rx_write, dequeued, written);
+            histogram_record(&timing->rx_total, p->read_time, written);
+            signpost_rx_end(p);
+        }
+        packet_free(args->pool, h);
     }
     return vargp;
 }
 
 void *rx_thread(void *vargp) {
-    thread_args *args = (thread_args *)vargp;
+    slip_link *args = (slip_link *)vargp;
 
-    unsigned char c[MTU];
-    unsigned char packet[MAX_PACKET_SIZE];
-
-    packet[0] = 0;
-    packet[1] = 0;
-    packet[2] = 0;
-    packet[3] = AF_INET;
+    unsigned char *discard = malloc(PACKET_BUFFER_SIZE(args->mtu));
+    if (discard == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    slip_reader reader;
+
+    slip_reader_init(&reader, args->serialfd);
+    reader.timestamps = args->timing != NULL;
+    forwarding_thread_started(args, THREAD_RX);
+    if (args->cslip) {
+        // The new remote knows nothing about the old one's connections, and
+        // knows nothing about ours either. TX state belongs to the TX
+        // encoder, so it resets that itself.
+        vj_reset_rx(args->vj);
+        atomic_store(&args->vj_tx_reset, 1);
+    }
 
-    // Read from serial and forward it to tunnel
+    // Read from serial and queue it for the tunnel writer. Packets are
+    // decoded straight into a pool buffer, after the headroom.
+    packet_handle h = PACKET_NONE;
+    unsigned long counted = 0;
     while (1) {
+        if (h == PACKET_NONE) {
+            h = packet_alloc(args->pool);
+        }
+        // Out of buffers, decode the packet only to drop it
+        unsigned char *buf =
+            h != PACKET_NONE ? packet_get(args->pool, h)->data : discard;
+
+        unsigned char *ip = &buf[PACKET_HEADROOM];
         int length;
-        length = next_slip_packet(args->serialfd, c);
-        if (length < 0) {
-            return vargp;
+        if (IS_DATAGRAM(args->device_type)) {
+            length = datagram_receive(args, ip, MAX_FRAME_SIZE(args->mtu));
+        } else if (args->byte_decoder) {
+            length = next_slip_packet(args->serialfd, ip,
+                                      MAX_FRAME_SIZE(args->mtu));
+        } else {
+            length = next_slip_packet_buffered(&reader, ip,
+                                               MAX_FRAME_SIZE(args->mtu));
+            STAT_ADD(args->stats.rx_wire_bytes, reader.bytes_read - counted);
+            counted = reader.bytes_read;
+        }
+        if (length == SLIP_PACKET_TOO_LONG) {
+            STAT_ADD(args->stats.rx_too_long, 1);
+            rx_frame_lost(args);
+            continue;
+        } else if (length == SLIP_DECODE_ERROR) {
+            // The decoder has already skipped to the next frame, a glitch on
+            // the line isn't worth reconnecting for
+            STAT_ADD(args->stats.rx_decode_errors, 1);
+            rx_frame_lost(args);
+            continue;
+        } else if (length < 0) {
+            break;
         } else if (length < 1) {
             continue;
         }
-        // Copy into packet. The first 4 bytes of packet are static
-        // and remain the same, so we copy after them
-        memcpy(&packet[4], c, length);
-        length += 4;
+        STAT_ADD(args->stats.rx_frame_bytes, length);
+        length = remove_frame_check(args, ip, length);
+        if (length == -1) {
+            STAT_ADD(args->stats.rx_crc_errors, 1);
+            rx_frame_lost(args);
+            continue;
+        }
 
-#ifdef DEBUG
-        printf("RX:\n");
-        for (int i = 0; i < length; i++) {
-            printf("%02x ", packet[i]);
-            if ((i - 4) % 16 == 15)
-                printf("\n");
+        uint64_t decoded = 0;
+        uint64_t started = 0;
+        if (args->timing) {
+            // The byte decoder can't tell when the frame started, and a
+            // datagram arrives all at once
+            decoded = timing_now();
+            started = args->byte_decoder || IS_DATAGRAM(args->device_type)
+                          ? decoded
+                          : reader.started;
+            histogram_record(&args->timing->rx_wire, started, decoded);
+        }
+
+        if (args->bond) {
+            // A bond member only decodes, the link puts frames back in
+            // order before the stages see them
+            if (h == PACKET_NONE) {
+                continue;
+            }
+            packet *p = packet_get(args->pool, h);
+            p->read_time = started;
+            p->ready_time = decoded;
+            if (bond_receive(args->bond, h, ip, length) == 0) {
+                STAT_ADD(args->stats.rx_packets, 1);
+                h = PACKET_NONE;
+            }
+            continue;
         }
-        printf("\n");
-#endif
 
-        write(args->utunfd, packet, length);
+        // Even a packet that is going to be dropped has to go through the
+        // stages, as it may update their state
+        length = rx_stages(args, &ip, length);
+        if (length < 1) {
+            STAT_ADD(args->stats.rx_stage_dropped, 1);
+            continue;
+        } else if (h == PACKET_NONE) {
+            continue;
+        }
+        if (args->capture) {
+            capture_packet(args->capture, CAPTURE_RX, ip, length);
+        }
+
+        packet *p = packet_get(args->pool, h);
+        p->offset = ip - p->data;
+        p->length = length;
+        if (args->timing) {
+            p->read_time = started;
+            p->ready_time = decoded;
+            p->queued_time = timing_now();
+            signpost_rx_begin(p);
+        }
+        if (packet_queue_push(args->rx_queue, h) == -1) {
+            if (args->timing) {
+                signpost_rx_end(p);
+            }
+            // Keep the buffer for the next packet
+            continue;
+        }
+        h = PACKET_NONE;
     }
+
+    if (h != PACKET_NONE) {
+        packet_free(args->pool, h);
+    }
+    free(discard);
     return vargp;
 }
 
-int create_utun(int *utun_num) {
-    int num = 0;
+void *bond_tx_thread(void *vargp) {
+    slip_link *args = (slip_link *)vargp;
 
-    int fd = -1;
+    // Takes the place of tx_writer_thread() on a bonded link. The stages
+    // have to see packets in order so they run here, then each frame is
+    // handed to the writer of one of the members.
+    forwarding_thread_started(args, THREAD_TX);
+    while (1) {
+        packet_handle h = tx_scheduler_pop(args->tx_queue, -1);
+        packet *p = packet_get(args->pool, h);
+        unsigned char *ip = &p->data[p->offset];
+        if (args->timing) {
+            histogram_record(&args->timing->tx_queue, p->read_time,
+                             timing_now());
+        }
 
-    while (num < MAX_UTUN_NUMBER) {
-        int result = tun(num);
-        if (result != -1) {
-            fd = result;
-            break;
+        int len = tx_stages(args, &ip, p->length);
+        if (len > 0) {
+            STAT_ADD(args->stats.tx_frame_bytes, len);
+            p->offset = ip - p->data;
+            p->length = len;
+            if (bond_send(args->bond, h) == 0) {
+                continue;
+            }
+        } else {
+            STAT_ADD(args->stats.tx_stage_dropped, 1);
+        }
+        if (args->timing) {
+            signpost_tx_end(p);
+        }
+        packet_free(args->pool, h);
+    }
+    return vargp;
+}
+
+void *bond_writer_thread(void *vargp) {
+    slip_link *args = (slip_link *)vargp;
+    packet_queue *queue = bond_member_queue(args->bond, args);
+    int signposts = args->bond->link->timing != NULL;
+
+    unsigned char *encoded = malloc(MAX_PACKET_SIZE_SLIP(args->mtu));
+    if (encoded == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    forwarding_thread_started(args, THREAD_TX);
+
+    while (1) {
+        packet_handle h = packet_queue_pop(queue, -1);
+        packet *p = packet_get(args->pool, h);
+
+        uint64_t write_start = args->timing ? timing_now() : 0;
+        unsigned char *frame = &p->data[p->offset];
+        int length = add_frame_check(args, frame, p->length);
+        write_packet(args, frame, length, encoded);
+        STAT_ADD(args->stats.tx_packets, 1);
+        STAT_ADD(args->stats.tx_frame_bytes, length);
+        if (args->timing) {
+            uint64_t written = timing_now();
+            histogram_record(&args->timing->tx_write, write_start, written);
+            histogram_record(&args->timing->tx_total, p->read_time, written);
         }
-        num++;
+        if (signposts) {
+            signpost_tx_end(p);
+        }
+        packet_free(args->pool, h);
     }
+    return vargp;
+}
+
+void *bond_rx_thread(void *vargp) {
+    slip_link *args = (slip_link *)vargp;
+
+    // Runs the stages on what the members have decoded, in the order it
+    // was sent, and queues it for the utun writer
+    forwarding_thread_started(args, THREAD_RX);
+    while (1) {
+        int lost;
+        packet_handle h = bond_next(args->bond, &lost);
+        if (lost && args->cslip) {
+            // VJ can't tell a packet went missing, make it resync
+            vj_reset_rx(args->vj);
+        }
+
+        packet *p = packet_get(args->pool, h);
+        STAT_ADD(args->stats.rx_frame_bytes, p->length);
+        unsigned char *ip = &p->data[p->offset];
+        int length = rx_stages(args, &ip, p->length);
+        if (length < 1) {
+            STAT_ADD(args->stats.rx_stage_dropped, 1);
+            packet_free(args->pool, h);
+            continue;
+        }
+        if (args->capture) {
+            capture_packet(args->capture, CAPTURE_RX, ip, length);
+        }
 
+        p->offset = ip - p->data;
+        p->length = length;
+        if (args->timing) {
+            p->queued_time = timing_now();
+            signpost_rx_begin(p);
+        }
+        if (packet_queue_push(args->rx_queue, h) == -1) {
+            if (args->timing) {
+                signpost_rx_end(p);
+            }
+            packet_free(args->pool, h);
+        }
+    }
+    return vargp;
+}
+
+void *bond_member_thread(void *vargp) {
+    slip_link *args = (slip_link *)vargp;
+    pthread_t writer_thread_id, rx_thread_id;
+
+    // Each device comes and goes on its own, the others carry on
+    pthread_create(&writer_thread_id, NULL, bond_writer_thread, vargp);
+    while (1) {
+        bond_member_up(args->bond, args, 1);
+        pthread_create(&rx_thread_id, NULL, rx_thread, vargp);
+
+        printf("utun%i: %s up\n", args->utun_num, args->device_path);
+
+        pthread_join(rx_thread_id, NULL);
+        bond_member_up(args->bond, args, 0);
+
+        printf("utun%i: %s lost, attempting reconnect...\n", args->utun_num,
+               args->device_path);
+
+        reconnect_device(args);
+    }
+    return vargp;
+}
+
+int create_utun(int *utun_num) {
+    int fd = tun();
     if (fd == -1) {
         fprintf(stderr, "Unable to create UTUN. Are you root?\n");
         exit(1);
     }
 
-    printf("Created utun%i\n", num);
+    // Find out which one we were given
+    char name[IFNAMSIZ];
+    socklen_t length = sizeof(name);
+    if (getsockopt(fd, SYSPROTO_CONTROL, UTUN_OPT_IFNAME, name, &length) ==
+            -1 ||
+        sscanf(name, "utun%i", utun_num) != 1) {
+        perror("getsockopt(UTUN_OPT_IFNAME)");
+        exit(1);
+    }
 
-    *utun_num = num;
+    printf("Created %s\n", name);
 
     return fd;
 }
 
-int connect_device(char device_type, char *device_path, int baud,
-                   int error_is_fatal) {
-    int fd;
+// Gets a TX write that is stuck on a dead device to return: held off by CTS,
+// or a socket whose send buffer the far end stopped emptying
+static void unblock_writer(slip_link *link) {
+    if (link->device_type == DEVICE_TYPE_HARDWARE) {
+        struct termios options;
+        tcflush(link->serialfd, TCOFLUSH);
+        if (tcgetattr(link->serialfd, &options) == 0 &&
+            (options.c_cflag & CRTSCTS)) {
+            options.c_cflag &= ~CRTSCTS;
+            tcsetattr(link->serialfd, TCSANOW, &options);
+        }
+    } else {
+        shutdown(link->serialfd, SHUT_RDWR);
+    }
+}
+
+void reconnect_device(slip_link *link) {
+    atomic_store(&link->device_up, 0);
+
+    // Let a write already under way finish before closing its fd. If it
+    // won't even once woken, close it anyway rather than hang the link; the
+    // writer then fails with EBADF.
+    int waited_ms = 0;
+    if (atomic_load(&link->tx_writing)) {
+        unblock_writer(link);
+    }
+    while (atomic_load(&link->tx_writing)) {
+        if (waited_ms >= WRITER_TIMEOUT_MS) {
+            fprintf(stderr, "utun%i: TX write didn't finish, closing the "
+                            "device anyway\n",
+                    link->utun_num);
+            break;
+        }
+        usleep(1000);
+        waited_ms++;
+    }
+    // Not worth stopping every other link for, the utun just stays up
+    if (link->utun_down) {
+        set_utun_up(link->utun_num, 0, 0);
+    }
+
+    close(link->serialfd);
+    link->serialfd = connect_device(link, 0);
+
+    if (link->utun_down) {
+        set_utun_up(link->utun_num, 1, 0);
+    }
+    atomic_store(&link->device_up, 1);
+}
+
+int connect_device(slip_link *link, int error_is_fatal) {
+    int fd = -1;
+    int delay_ms = RECONNECT_MIN_DELAY_MS;
 
     while (1) {
-        switch (device_type) {
+        switch (link->device_type) {
         case DEVICE_TYPE_HARDWARE:
-            fd = open_serial_port(device_path, baud);
+            fd = open_serial_port(link);
             break;
         case DEVICE_TYPE_SOCKET_CLIENT:
-            fd = open_unix_domain_socket_as_client(device_path, error_is_fatal);
+            fd = open_unix_domain_socket_as_client(link->device_path,
+                                                   error_is_fatal);
             break;
         case DEVICE_TYPE_SOCKET_SERVER:
-            fd = open_unix_domain_socket_as_server(device_path);
+            if (link->listenfd == -1) {
+                link->listenfd = open_unix_domain_socket_as_server(
+                    link->device_path, SOCK_STREAM);
+            }
+            fd = accept_unix_domain_socket_client(link->listenfd);
+            break;
+        case DEVICE_TYPE_DATAGRAM_CLIENT:
+            fd = open_datagram_socket_as_client(link->device_path,
+                                                error_is_fatal);
+            break;
+        case DEVICE_TYPE_DATAGRAM_SERVER:
+            fd = open_datagram_socket_as_server(link);
+            break;
+        case DEVICE_TYPE_TCP:
+            fd = open_inet_socket(link->device_path, SOCK_STREAM,
+                                  error_is_fatal);
+            break;
+        case DEVICE_TYPE_UDP:
+            fd = open_inet_socket(link->device_path, SOCK_DGRAM,
+                                  error_is_fatal);
             break;
         }
 
-        if (fd == -1) {
-            if (error_is_fatal) {
-                fprintf(stderr, "Unable to open device\n");
-                exit(1);
-            } else {
-                continue;
+        if (fd != -1) {
+            int size = link->socket_buffer;
+            // Only AF_UNIX datagram buffers are too small to start with
+            if (size <= 0 && IS_DATAGRAM(link->device_type) &&
+                link->device_type != DEVICE_TYPE_UDP) {
+                size = DATAGRAM_BUFFER_SIZE;
+            }
+            if (link->device_type != DEVICE_TYPE_HARDWARE && size > 0) {
+                set_socket_buffers(fd, size, "socket");
+            }
+            if (!error_is_fatal) {
+                STAT_ADD(link->stats.reconnects, 1);
             }
-        } else {
             return fd;
+        } else if (error_is_fatal) {
+            fprintf(stderr, "Unable to open device\n");
+            exit(1);
+        }
+
+        // Back off, with jitter so several instances don't retry in step.
+        // A serial device coming back (see watch_for_device()) cuts the wait
+        // short.
+        int wait_ms = delay_ms / 2 + arc4random_uniform(delay_ms / 2 + 1);
+        dispatch_semaphore_wait(
+            link->device_arrived,
+            dispatch_time(DISPATCH_TIME_NOW, wait_ms * NSEC_PER_MSEC));
+        delay_ms *= 2;
+        if (delay_ms > RECONNECT_MAX_DELAY_MS) {
+            delay_ms = RECONNECT_MAX_DELAY_MS;
         }
     }
 }
 
-void run_ifconfig(int utun_num, char *local_ip, char *remote_ip) {
-    char ifconfig[50];
+// The interface is configured with ioctl()s on a socket, rather than by
+// running ifconfig for each setting
+// Returns -1 on error, unless error_is_fatal
+static int interface_request(int utun_num, int family, unsigned long request,
+                             void *req, const char *name,
+                             int error_is_fatal) {
+    int fd = socket(family, SOCK_DGRAM, 0);
+    if (fd == -1) {
+        perror("socket");
+        if (error_is_fatal) {
+            exit(1);
+        }
+        return -1;
+    }
+    // Every request starts with the interface name
+    snprintf((char *)req, IFNAMSIZ, "utun%i", utun_num);
+    int result = ioctl(fd, request, req);
+    if (result == -1) {
+        perror(name);
+        if (error_is_fatal) {
+            exit(1);
+        }
+    }
+    close(fd);
+    return result;
+}
 
-    sprintf(ifconfig, "ifconfig utun%i %s %s", utun_num, local_ip, remote_ip);
+static void set_address(int utun_num, const char *local_ip,
+                        const char *remote_ip) {
+    struct ifaliasreq req;
+    memset(&req, 0, sizeof(req));
+
+    // Point to point, so the remote address goes where the broadcast
+    // address would
+    struct sockaddr_in *addresses[] = {
+        (struct sockaddr_in *)&req.ifra_addr,
+        (struct sockaddr_in *)&req.ifra_broadaddr,
+        (struct sockaddr_in *)&req.ifra_mask};
+    const char *ips[] = {local_ip, remote_ip, "255.255.255.255"};
+    for (int i = 0; i < 3; i++) {
+        addresses[i]->sin_len = sizeof(struct sockaddr_in);
+        addresses[i]->sin_family = AF_INET;
+        if (inet_pton(AF_INET, ips[i], &addresses[i]->sin_addr) != 1) {
+            fprintf(stderr, "Invalid address %s\n", ips[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    printf("Setting utun%i address %s, remote %s\n", utun_num, local_ip,
+           remote_ip);
+    interface_request(utun_num, AF_INET, SIOCAIFADDR, &req,
+                      "ioctl(SIOCAIFADDR)", 1);
+}
+
+static void set_address6(int utun_num, const char *local_ip6) {
+    struct in6_aliasreq req;
+    memset(&req, 0, sizeof(req));
+
+    // Address is given as addr/prefixlen, default to a /64
+    char address[INET6_ADDRSTRLEN];
+    int prefix_length = 64;
+    size_t length = strcspn(local_ip6, "/");
+    snprintf(address, sizeof(address), "%.*s", (int)length, local_ip6);
+    if (local_ip6[length] == '/') {
+        prefix_length = atoi(&local_ip6[length + 1]);
+    }
+
+    req.ifra_addr.sin6_len = sizeof(struct sockaddr_in6);
+    req.ifra_addr.sin6_family = AF_INET6;
+    if (inet_pton(AF_INET6, address, &req.ifra_addr.sin6_addr) != 1 ||
+        prefix_length < 1 || prefix_length > 128) {
+        fprintf(stderr, "Invalid address %s\n", local_ip6);
+        exit(EXIT_FAILURE);
+    }
+    req.ifra_prefixmask.sin6_len = sizeof(struct sockaddr_in6);
+    req.ifra_prefixmask.sin6_family = AF_INET6;
+    unsigned char *mask = req.ifra_prefixmask.sin6_addr.s6_addr;
+    for (int i = 0; i < 16; i++) {
+        int bits = prefix_length - i * 8;
+        mask[i] = bits >= 8 ? 0xff : bits > 0 ? 0xff << (8 - bits) : 0;
+    }
+    req.ifra_lifetime.ia6t_vltime = ND6_INFINITE_LIFETIME;
+    req.ifra_lifetime.ia6t_pltime = ND6_INFINITE_LIFETIME;
+
+    printf("Setting utun%i address %s/%i\n", utun_num, address,
+           prefix_length);
+    interface_request(utun_num, AF_INET6, SIOCAIFADDR_IN6, &req,
+                      "ioctl(SIOCAIFADDR_IN6)", 1);
+}
+
+int set_utun_up(int utun_num, int up, int error_is_fatal) {
+    struct ifreq ifr;
+
+    memset(&ifr, 0, sizeof(ifr));
+    if (interface_request(utun_num, AF_INET, SIOCGIFFLAGS, &ifr,
+                          "ioctl(SIOCGIFFLAGS)", error_is_fatal) == -1) {
+        return -1;
+    }
+    if (up) {
+        ifr.ifr_flags |= IFF_UP;
+    } else {
+        ifr.ifr_flags &= ~IFF_UP;
+    }
+    return interface_request(utun_num, AF_INET, SIOCSIFFLAGS, &ifr,
+                             "ioctl(SIOCSIFFLAGS)", error_is_fatal);
+}
+
+void configure_utun(int utun_num, const char *local_ip, const char *remote_ip,
+                    const char *local_ip6, int mtu) {
+    struct ifreq ifr;
+
+    set_address(utun_num, local_ip, remote_ip);
+    if (local_ip6) {
+        set_address6(utun_num, local_ip6);
+    }
+
+    if (mtu != DEFAULT_MTU) {
+        printf("Setting utun%i MTU to %i\n", utun_num, mtu);
+        memset(&ifr, 0, sizeof(ifr));
+        ifr.ifr_mtu = mtu;
+        interface_request(utun_num, AF_INET, SIOCSIFMTU, &ifr,
+                          "ioctl(SIOCSIFMTU)", 1);
+    }
+
+    set_utun_up(utun_num, 1, 1);
+}
 
-    printf("Running: %s\n", ifconfig);
-    if (system(ifconfig) != 0) {
-        fprintf(stderr, "ifconfig failed\n");
+// Settings from the command line that every link shares
+typedef struct link_options {
+    char *local_ip6;
+    char *filter_path;
+    char *capture_path;
+    int capture_per_link; // capture to capture_path.utunN
+    char *compression;
+    int compress_min_size;
+    int byte_decoder;
+    int frame_check;
+    int cslip;
+    int timing;
+    int batch_bytes;
+    int batch_latency_us;
+    int priority;
+    int affinity;
+    char engine;
+    char scheduler;
+    int queue_depth;
+    int flow_control;
+    int vmin;
+    int vtime;
+    int data_latency_us;
+    int socket_buffer;   // for the utun and socket devices, 0 for default
+    int utun_pending;    // UTUN_OPT_MAX_PENDING_PACKETS, 0 for default
+    int utun_down;       // while the device is lost
+    char **bond_devices; // device[@baud] for each member, or NULL
+    int bond_count;
+    int bond_timeout_ms; // 0 for the default
+} link_options;
+
+// Stripes link across options->bond_devices. Each member is a copy of the
+// link with its own device, counters and timing, and none of the stages.
+void setup_bond(slip_link *link, link_options *options) {
+    slip_link *members = calloc(options->bond_count, sizeof(slip_link));
+    link->bond = malloc(sizeof(bond));
+    if (members == NULL || link->bond == NULL) {
+        perror("malloc");
         exit(1);
     }
+
+    for (int i = 0; i < options->bond_count; i++) {
+        slip_link *member = &members[i];
+        char *device = options->bond_devices[i];
+
+        member->utunfd = link->utunfd;
+        member->utun_num = link->utun_num;
+        member->serialfd = -1;
+        member->device_type = link->device_type;
+        member->device_path = device;
+        member->baud = link->baud;
+        member->socket_buffer = link->socket_buffer;
+        member->flow_control = link->flow_control;
+        member->vmin = link->vmin;
+        member->vtime = link->vtime;
+        member->data_latency_us = link->data_latency_us;
+        char *baud = strchr(device, '@');
+        if (baud) {
+            *baud++ = '\0';
+            member->baud = parse_baud(baud);
+            if (member->baud == -1) {
+                fprintf(stderr, "Invalid baud rate %s\n", baud);
+                exit(EXIT_FAILURE);
+            }
+        }
+        member->listenfd = -1;
+        // The bond steers around a member that is down, the utun stays up
+        atomic_init(&member->device_up, 1);
+        atomic_init(&member->tx_writing, 0);
+        member->utun_down = 0;
+        member->device_arrived = dispatch_semaphore_create(0);
+        member->engine = link->engine;
+        member->mtu = link->mtu;
+        member->byte_decoder = link->byte_decoder;
+        member->priority = link->priority;
+        member->affinity = link->affinity;
+        member->frame_check = link->frame_check;
+        member->pool = link->pool;
+        member->timing = link->timing ? timing_create() : NULL;
+        member->bond = link->bond;
+    }
+    link->device_path = members[0].device_path;
+    link->baud = members[0].baud;
+
+    bond_init(link->bond, link, members, options->bond_count,
+              options->queue_depth, options->bond_timeout_ms);
 }
 
-int main(int argc, char **argv) {
-    thread_args thread_args;
+// Creates and configures link's utun and its per-packet state
+void setup_link(slip_link *link, link_config *config, link_options *options) {
+#ifdef DEBUG
+    printf("Device: %s Type: %c Local: %s Remote: %s Baud: %i\n",
+           config->device_path, config->device_type, config->local_ip,
+           config->remote_ip, config->baud);
+#endif
+
+    link->device_type = config->device_type;
+    link->device_path = config->device_path;
+    link->baud = config->baud;
+    atomic_init(&link->device_up, 1);
+    atomic_init(&link->tx_writing, 0);
+    link->utun_down = options->utun_down && !options->bond_devices;
+    link->flow_control = options->flow_control;
+    link->vmin = options->vmin;
+    link->vtime = options->vtime;
+    link->data_latency_us = options->data_latency_us;
+    link->engine = options->engine;
+    link->mtu = config->mtu;
+    link->byte_decoder = options->byte_decoder;
+    link->priority = options->priority;
+    link->affinity = options->affinity;
+    link->frame_check = options->frame_check;
+    link->cslip = options->cslip;
+    link->ipv6 = options->local_ip6 != NULL;
+    // Every packet is a datagram of its own, so there's nothing to batch
+    if (!IS_DATAGRAM(config->device_type)) {
+        link->batch_bytes = options->batch_bytes;
+        link->batch_latency_us = options->batch_latency_us;
+    }
+
+    link->utunfd = create_utun(&link->utun_num);
+    link->socket_buffer = options->socket_buffer;
+    if (options->socket_buffer > 0) {
+        // The kernel queues packets for us to read in the utun's receive
+        // buffer, and drops them once it is full
+        set_socket_buffers(link->utunfd, options->socket_buffer, "utun");
+    }
+    if (options->utun_pending > 0 &&
+        setsockopt(link->utunfd, SYSPROTO_CONTROL,
+                   UTUN_OPT_MAX_PENDING_PACKETS, &options->utun_pending,
+                   sizeof(options->utun_pending)) == -1) {
+        perror("setsockopt(UTUN_OPT_MAX_PENDING_PACKETS)");
+    }
+    configure_utun(link->utun_num, config->local_ip, config->remote_ip,
+                   options->local_ip6, link->mtu);
+
+    link->vj = NULL;
+    atomic_init(&link->vj_tx_reset, 0);
+    if (options->cslip) {
+        link->vj = malloc(sizeof(vj_compressor));
+        if (link->vj == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        vj_init(link->vj);
+    }
+    link->timing = options->timing ? timing_create() : NULL;
+    link->capture = NULL;
+    if (options->capture_path) {
+        char path[1024];
+        if (options->capture_per_link) {
+            snprintf(path, sizeof(path), "%s.utun%i", options->capture_path,
+                     link->utun_num);
+        } else {
+            snprintf(path, sizeof(path), "%s", options->capture_path);
+        }
+        link->capture = malloc(sizeof(packet_capture));
+        if (link->capture == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        capture_start(link->capture, path, link->mtu);
+    }
+    link->filter = NULL;
+    if (options->filter_path) {
+        link->filter = malloc(sizeof(packet_filter));
+        if (link->filter == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        if (filter_load(link->filter, options->filter_path) == -1) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    link->compressor = NULL;
+    if (options->compression) {
+        link->compressor = malloc(sizeof(frame_compressor));
+        if (link->compressor == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        if (frame_compressor_init(link->compressor, options->compression,
+                                  options->compress_min_size,
+                                  link->mtu) == -1) {
+            fprintf(stderr, "Unknown compression %s\n", options->compression);
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    char *device_path;
-    char *local_ip;
-    char *remote_ip;
-    int baud = DEFAULT_BAUD;
-    char device_type = DEVICE_TYPE_HARDWARE;
+    link->listenfd = -1;
+    link->device_arrived = dispatch_semaphore_create(0);
+
+    if (link->engine != ENGINE_THREADS) {
+        return;
+    }
+
+    // Enough buffers to fill every queue, plus one being filled and one
+    // being written for each direction. A bond also needs them for each
+    // member's queue, reader and writer, and its reorder buffer.
+    int tx_queues = options->scheduler == SCHEDULER_PRIORITY ? TX_CLASSES : 1;
+    size_t buffers = (tx_queues + 1) * options->queue_depth + 4;
+    if (options->bond_devices) {
+        buffers += options->bond_count * (options->queue_depth + 2) +
+                   BOND_REORDER_WINDOW;
+    }
+    link->pool = malloc(sizeof(packet_pool));
+    link->tx_queue = malloc(sizeof(tx_scheduler));
+    link->rx_queue = malloc(sizeof(packet_queue));
+    if (!link->pool || !link->tx_queue || !link->rx_queue) {
+        perror("malloc");
+        exit(1);
+    }
+    packet_pool_init(link->pool, buffers, link->mtu);
+    tx_scheduler_init(link->tx_queue, options->scheduler,
+                      options->queue_depth, link->pool, link->mtu);
+    packet_queue_init(link->rx_queue, options->queue_depth);
+
+    if (options->bond_devices) {
+        setup_bond(link, options);
+    }
+}
+
+// Forwards packets for link with a blocking thread for each direction and
+// each side, reconnecting the device as needed. Never returns.
+void run_threads_engine(slip_link *link) {
+    pthread_t tx_thread_id, tx_writer_thread_id, rx_thread_id,
+        rx_writer_thread_id;
+
+    pthread_create(&tx_thread_id, NULL, tx_thread, (void *)link);
+    pthread_create(&rx_writer_thread_id, NULL, rx_writer_thread,
+                   (void *)link);
+
+    if (link->bond) {
+        bond *bond = link->bond;
+        pthread_create(&tx_writer_thread_id, NULL, bond_tx_thread,
+                       (void *)link);
+        pthread_create(&rx_thread_id, NULL, bond_rx_thread, (void *)link);
+        pthread_t member_thread_ids[BOND_MAX_MEMBERS];
+        for (int i = 0; i < bond->count; i++) {
+            pthread_create(&member_thread_ids[i], NULL, bond_member_thread,
+                           (void *)&bond->members[i]);
+        }
+        for (int i = 0; i < bond->count; i++) {
+            pthread_join(member_thread_ids[i], NULL);
+        }
+        return;
+    }
+
+    pthread_create(&tx_writer_thread_id, NULL, tx_writer_thread,
+                   (void *)link);
+
+    while (1) {
+        pthread_create(&rx_thread_id, NULL, rx_thread, (void *)link);
+
+        printf("utun%i: SLIP connection up\n", link->utun_num);
+
+        pthread_join(rx_thread_id, NULL);
+
+        printf("utun%i: Device lost, attempting reconnect...\n",
+               link->utun_num);
+        printf("Packets dropped with queues full: %lu tx, %lu rx, out of "
+               "buffers: %lu\n",
+               tx_scheduler_dropped(link->tx_queue),
+               atomic_load(&link->rx_queue->dropped),
+               atomic_load(&link->pool->exhausted));
+        if (link->filter) {
+            printf("Packets filtered: %lu\n",
+                   atomic_load(&link->filter->dropped));
+        }
+
+        reconnect_device(link);
+    }
+}
+
+void run_engine(slip_link *link) {
+    if (link->engine == ENGINE_KQUEUE) {
+        run_kqueue_engine(link);
+    } else {
+        run_threads_engine(link);
+    }
+    printf("utun%i: utun failed, link stopped\n", link->utun_num);
+}
+
+void *link_thread(void *vargp) {
+    slip_link *link = (slip_link *)vargp;
+
+    // One device that isn't there yet mustn't stop the others, so the first
+    // open is retried like a reconnect
+    if (link->device_type == DEVICE_TYPE_HARDWARE) {
+        watch_for_device(link);
+    }
+    link->serialfd = connect_device(link, 0);
+    run_engine(link);
+    return vargp;
+}
+
+int main(int argc, char **argv) {
+    link_options options;
+    memset(&options, 0, sizeof(options));
+    options.compress_min_size = DEFAULT_COMPRESS_MIN_SIZE;
+    options.engine = ENGINE_THREADS;
+    options.scheduler = SCHEDULER_FIFO;
+    options.queue_depth = DEFAULT_QUEUE_DEPTH;
+    options.vmin = 1;
+
+    // The link given on the command line, also the defaults for -C
+    link_config single = {DEVICE_TYPE_HARDWARE, NULL, DEFAULT_BAUD,
+                          NULL, NULL, DEFAULT_MTU};
+    char *config_path = NULL;
+    char *stats_path = NULL;
 
     int opt;
 
-    while ((opt = getopt(argc, argv, "b:l:r:t:")) != -1) {
+    const char *optstring =
+        "6:ab:cd:e:f:k:l:m:p:q:r:s:t:w:y:z:A:B:C:FHL:O:Q:S:TV:Z:";
+    while ((opt = getopt(argc, argv, optstring)) != -1) {
         switch (opt) {
+        case '6':
+            options.local_ip6 = optarg;
+            break;
+        case 'A':
+            options.data_latency_us = atoi(optarg);
+            break;
+        case 'B':
+            options.batch_bytes = atoi(optarg);
+            break;
+        case 'C':
+            config_path = optarg;
+            break;
+        case 'F':
+            options.flow_control = 1;
+            break;
+        case 'H':
+            options.utun_down = 1;
+            break;
+        case 'L':
+            options.batch_latency_us = atoi(optarg);
+            break;
+        case 'O':
+            options.bond_timeout_ms = atoi(optarg);
+            break;
+        case 'Q':
+            if (strcmp(optarg, "fifo") == 0) {
+                options.scheduler = SCHEDULER_FIFO;
+            } else if (strcmp(optarg, "priority") == 0) {
+                options.scheduler = SCHEDULER_PRIORITY;
+            } else {
+                fprintf(stderr, "Unknown scheduler %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'S':
+            options.socket_buffer = atoi(optarg);
+            break;
+        case 'T':
+            options.timing = 1;
+            break;
+        case 'V':
+            // vmin[,vtime]
+            options.vtime = 0;
+            if (sscanf(optarg, "%i,%i", &options.vmin, &options.vtime) < 1 ||
+                options.vmin < 1 || options.vmin > 255 || options.vtime < 0 ||
+                options.vtime > 255) {
+                fprintf(stderr, "Invalid VMIN,VTIME %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'Z':
+            options.compress_min_size = atoi(optarg);
+            break;
+        case 'a':
+            options.affinity = 1;
+            break;
         case 'b':
-            baud = atoi(optarg);
+            single.baud = parse_baud(optarg);
+            if (single.baud == -1) {
+                fprintf(stderr, "Invalid baud rate %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'c':
+            options.cslip = 1;
+            break;
+        case 'd':
+            if (strcmp(optarg, "byte") == 0) {
+                options.byte_decoder = 1;
+            } else if (strcmp(optarg, "block") == 0) {
+                options.byte_decoder = 0;
+            } else {
+                fprintf(stderr, "Unknown decoder %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'e':
+            if (strcmp(optarg, "threads") == 0) {
+                options.engine = ENGINE_THREADS;
+            } else if (strcmp(optarg, "kqueue") == 0) {
+                options.engine = ENGINE_KQUEUE;
+            } else {
+                fprintf(stderr, "Unknown engine %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'f':
+            options.filter_path = optarg;
+            break;
+        case 'k':
+            options.frame_check = frame_check_parse(optarg);
+            if (options.frame_check == -1) {
+                fprintf(stderr, "Unknown frame check %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
             break;
         case 'l':
-            local_ip = optarg;
+            single.local_ip = optarg;
+            break;
+        case 'm':
+            single.mtu = atoi(optarg);
+            break;
+        case 'p':
+            options.utun_pending = atoi(optarg);
+            break;
+        case 'q':
+            options.queue_depth = atoi(optarg);
             break;
         case 'r':
-            remote_ip = optarg;
+            single.remote_ip = optarg;
+            break;
+        case 's':
+            stats_path = optarg;
             break;
         case 't':
-            device_type = optarg[0];
+            single.device_type = optarg[0];
+            break;
+        case 'w':
+            options.capture_path = optarg;
+            break;
+        case 'y':
+            options.priority = priority_parse(optarg);
+            if (options.priority == -1) {
+                fprintf(stderr, "Unknown priority %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'z':
+            options.compression = optarg;
             break;
         }
     }
 
     if (optind < argc) {
-        device_path = argv[optind];
+        single.device_path = argv[optind];
+    }
+    if (argc - optind > 1) {
+        // More than one device, stripe the link across them
+        options.bond_devices = &argv[optind];
+        options.bond_count = argc - optind;
     }
 
-#ifdef DEBUG
-    printf("Device: %s Type: %c Local: %s Remote: %s Baud: %i\n", device_path,
-           device_type, local_ip, remote_ip, baud);
-#endif
-
-    if (!(device_type == DEVICE_TYPE_HARDWARE ||
-          device_type == DEVICE_TYPE_SOCKET_SERVER ||
-          device_type == DEVICE_TYPE_SOCKET_CLIENT) ||
-        !local_ip || !remote_ip || !device_path) {
+    // With -C every link comes from the file, and one IPv6 address can't
+    // be given to all of them
+    int usable = options.queue_depth >= 1;
+    if (config_path) {
+        usable = usable && !options.local_ip6 && !single.device_path &&
+                 !single.local_ip && !single.remote_ip;
+    } else {
+        usable = usable && config_check(&single) == 0;
+    }
+    if (options.bond_devices) {
+        // Bonding needs threads to keep each device's writes to itself
+        usable = usable && options.bond_count <= BOND_MAX_MEMBERS &&
+                 options.engine == ENGINE_THREADS;
+    }
+    if (!usable) {
         fprintf(
             stderr,
-            "Usage: %s -l local_ip -r remote_ip [-b baud] [-t type] [device]\n",
-            argv[0]);
+            "Usage: %s -l local_ip -r remote_ip [-6 local_ip6[/prefixlen]] "
+            "[-b baud] [-t type] [-m mtu] [-c] [-z lz4|zlib] [-Z min_size] "
+            "[-k crc16|crc32c] "
+            "[-e engine] [-f filter_file] [-s stats_socket] [-T] "
+            "[-w pcap_file] [-d decoder] [-q queue_depth] [-Q scheduler] "
+            "[-B batch_bytes] [-L batch_latency_us] [-O bond_timeout_ms] "
+            "[-S socket_buffer] [-p utun_pending] [-F] [-V vmin[,vtime]] "
+            "[-A data_latency_us] [-y interactive|realtime] [-a] [-H] "
+            "device[@baud]...\n"
+            "       %s -C links_file [-b baud] [-m mtu] [options]\n",
+            argv[0], argv[0]);
         exit(EXIT_FAILURE);
     }
 
-    int utun_num;
-
-    thread_args.utunfd = create_utun(&utun_num);
-
-    run_ifconfig(utun_num, local_ip, remote_ip);
-
-    // The first time we try to open the device any error should be fatal
-    // as this is likely a config problem.
-    // After that we will try to reconnect in the event of an error, for
-    // example due to serial line being disconnected, socket server restart
-    // etc.
-    thread_args.serialfd = connect_device(device_type, device_path, baud, 1);
-
-    pthread_t tx_thread_id, rx_thread_id;
+    link_config *configs = &single;
+    int count = 1;
+    if (config_path) {
+        configs = malloc(CONFIG_MAX_LINKS * sizeof(link_config));
+        if (configs == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        count = config_load(config_path, configs, single.baud, single.mtu);
+        if (count == -1) {
+            exit(EXIT_FAILURE);
+        }
+        options.capture_per_link = 1;
+    }
 
-    pthread_create(&tx_thread_id, NULL, tx_thread, (void *)&thread_args);
+    slip_select_kernel(NULL);
 
-    while (1) {
-        pthread_create(&rx_thread_id, NULL, rx_thread, (void *)&thread_args);
+#ifdef DEBUG
+    printf("SLIP kernel: %s\n", slip_kernel_name());
+#endif
 
-        printf("SLIP connection up\n");
+    // A socket device going away is noticed by the reader and reconnected,
+    // it mustn't kill us from inside a write first
+    signal(SIGPIPE, SIG_IGN);
 
-        pthread_join(rx_thread_id, NULL);
-
-        printf("Device lost, attempting reconnect...\n");
+    slip_link *links = calloc(count, sizeof(slip_link));
+    if (links == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (int i = 0; i < count; i++) {
+        setup_link(&links[i], &configs[i], &options);
+    }
 
-        thread_args.serialfd = connect_device(device_type, device_path, baud, 0);
+    if (!config_path) {
+        // The first time we try to open the device any error should be
+        // fatal as this is likely a config problem.
+        // After that we will try to reconnect in the event of an error, for
+        // example due to serial line being disconnected, socket server
+        // restart etc.
+        slip_link *devices = &links[0];
+        int device_count = 1;
+        if (links[0].bond) {
+            devices = links[0].bond->members;
+            device_count = links[0].bond->count;
+        }
+        for (int i = 0; i < device_count; i++) {
+            devices[i].serialfd = connect_device(&devices[i], 1);
+            if (devices[i].device_type == DEVICE_TYPE_HARDWARE) {
+                watch_for_device(&devices[i]);
+            }
+        }
+        start_stats(links, 1, stats_path);
+        run_engine(&links[0]);
+        return 1;
     }
 
-    return 0;
-}
\ No newline at end of file
+    // Each link gets a thread of its own (plus the threads engine's),
+    // they have nothing else in common
+    start_stats(links, count, stats_path);
+    pthread_t *threads = malloc(count * sizeof(pthread_t));
+    if (threads == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < count; i++) {
+        pthread_create(&threads[i], NULL, link_thread, &links[i]);
+    }
+    for (int i = 0; i < count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    return 1;
+}
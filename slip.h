@@ -0,0 +1,177 @@
+#ifndef SLIP_H
+#define SLIP_H
+
+#include <dispatch/dispatch.h>
+#include <stdio.h>
+
+#include "stats.h"
+
+#define DEVICE_TYPE_HARDWARE 'h'
+#define DEVICE_TYPE_SOCKET_CLIENT 'c'
+#define DEVICE_TYPE_SOCKET_SERVER 's'
+#define DEVICE_TYPE_DATAGRAM_CLIENT 'C'
+#define DEVICE_TYPE_DATAGRAM_SERVER 'S'
+#define DEVICE_TYPE_TCP 't'
+#define DEVICE_TYPE_UDP 'u'
+
+// Datagram devices carry each frame as a message of its own, without SLIP
+#define IS_DATAGRAM(type)                                                      \
+    ((type) == DEVICE_TYPE_DATAGRAM_CLIENT ||                                  \
+     (type) == DEVICE_TYPE_DATAGRAM_SERVER || (type) == DEVICE_TYPE_UDP)
+
+#define ENGINE_THREADS 't'
+#define ENGINE_KQUEUE 'k'
+
+#define DEFAULT_MTU 1500
+#define MIN_MTU 68
+#define MAX_MTU 65535
+
+// Buffer sizes for a given MTU. The loopback header only exists on the utun
+// side so it's never SLIP encoded.
+#define NULL_LOOPBACK_HEADER_SIZE 4
+#define MAX_PACKET_SIZE(mtu) ((mtu) + NULL_LOOPBACK_HEADER_SIZE)
+// Stages can add up to this much to a packet on the wire (the compression
+// framing byte, the bond sequence number and the frame check)
+#define MAX_STAGE_OVERHEAD 7
+#define MAX_FRAME_SIZE(mtu) ((mtu) + MAX_STAGE_OVERHEAD)
+#define MAX_PACKET_SIZE_SLIP(mtu)                                              \
+    (MAX_FRAME_SIZE(mtu) * 2 + 1) // worst case all escaped plus the end
+
+// Room kept in front of every IP packet so stages can grow its headers in
+// place (VJ decompression rebuilds up to 120 bytes of TCP/IP header) and the
+// loopback header still fits in front.
+#define PACKET_HEADROOM 128
+
+// A buffer big enough for a packet with headroom, or for its SLIP encoding
+#define PACKET_BUFFER_SIZE(mtu) (PACKET_HEADROOM + MAX_PACKET_SIZE_SLIP(mtu))
+
+// #define DEBUG
+
+struct packet_pool;
+struct packet_queue;
+struct tx_scheduler;
+struct vj_compressor;
+struct frame_compressor;
+struct packet_filter;
+struct link_timing;
+struct packet_capture;
+struct bond;
+struct datagram_peer;
+
+// Everything needed to forward packets between one utun and one device.
+typedef struct slip_link {
+    int utunfd;
+    int utun_num;
+    int serialfd;
+
+    // How to (re)open the device
+    char device_type;
+    char *device_path;
+    int baud;
+    int flow_control; // RTS/CTS
+    int vmin, vtime;  // termios read thresholds
+    int data_latency_us; // IOSSDATALAT, 0 to leave the driver's
+    int listenfd; // server socket, kept open across connections, or -1
+    int socket_buffer; // SO_SNDBUF/SO_RCVBUF for sockets, 0 for default
+    dispatch_semaphore_t device_arrived; // cuts a reconnect backoff short
+    struct datagram_peer *peer; // a datagram server's client, else NULL
+
+    // Cleared while the device is being reconnected. Meanwhile packets for
+    // it are dropped rather than written to a dead fd or left queued.
+    atomic_int device_up;
+    atomic_int tx_writing; // the TX writer is using serialfd
+    int utun_down;         // -H, take the utun down too
+
+    char engine;
+    int mtu;
+    int byte_decoder;
+    int frame_check; // FRAME_CHECK_* trailer on every frame on the wire
+    int cslip; // VJ TCP/IP header compression
+    int ipv6;  // forward IPv6, otherwise it is dropped
+    int batch_bytes;      // 0 sends each packet with its own write()
+    int batch_latency_us; // how long a batch may wait for more packets
+    int priority; // PRIORITY_* for the forwarding threads
+    int affinity; // give them affinity tags
+
+    // Between the reader and writer threads of each direction. Packets in
+    // the queues are buffers from pool.
+    struct packet_pool *pool;
+    struct tx_scheduler *tx_queue;
+    struct packet_queue *rx_queue;
+
+    // Per-packet stage state. TX state is only touched by whoever encodes
+    // packets for the device, RX state by whoever decodes them.
+    struct vj_compressor *vj;
+    atomic_int vj_tx_reset; // set to make the TX encoder call vj_reset_tx()
+    struct frame_compressor *compressor; // NULL when compression is off
+    struct packet_filter *filter;        // applied to TX, NULL for none
+
+    link_stats stats;
+    struct link_timing *timing; // latency histograms, NULL unless -T
+    struct packet_capture *capture; // NULL unless -w
+
+    // Set on a link striped across several devices, and on each of its
+    // members. A member only has its device, the rest is the link's.
+    struct bond *bond;
+} slip_link;
+
+// Opens link's device, retrying with backoff until it succeeds unless
+// error_is_fatal.
+int connect_device(slip_link *link, int error_is_fatal);
+
+// Replaces link's lost device with a new one, marking the link down until
+// it is back. Must not be called from the TX writer.
+void reconnect_device(slip_link *link);
+
+// Sets or clears IFF_UP on utun_num. Returns -1 on error, unless
+// error_is_fatal when it exits.
+int set_utun_up(int utun_num, int up, int error_is_fatal);
+
+// Creates a Unix domain socket of type bound to socket_path, listening if it
+// is a SOCK_STREAM, exiting on error.
+int open_unix_domain_socket_as_server(const char *socket_path, int type);
+
+// Writes link's counters to out as one line of JSON.
+void write_stats(slip_link *link, FILE *out);
+
+// Dumps the counters of every link, one line each, to stdout on SIGUSR1, and
+// to anyone connecting to socket_path unless it is NULL, from a thread of its
+// own.
+void start_stats(slip_link *links, int count, const char *socket_path);
+
+// Signals link->device_arrived whenever the serial device appears, so a
+// reconnect doesn't have to wait for its next retry. The semaphore is the
+// one the link was set up with, connect_device() may be waiting on it.
+void watch_for_device(slip_link *link);
+
+// Per-packet stages shared by both engines. They run on the IP packet at *ip,
+// which must have PACKET_HEADROOM in front of it, and may move it within its
+// buffer. They return the new length, or -1 to drop the packet.
+int tx_stages(slip_link *link, unsigned char **ip, int length);
+int rx_stages(slip_link *link, unsigned char **ip, int length);
+
+// The frame check goes on last and comes off first, around everything the
+// device carries including a bond's sequence number. frame must have room
+// for the trailer after it. Both return the new length, or -1 if the frame
+// failed the check.
+int add_frame_check(slip_link *link, unsigned char *frame, int length);
+int remove_frame_check(slip_link *link, unsigned char *frame, int length);
+
+// Called when a frame from the device had to be dropped before the stages
+// saw it, so they can resync.
+void rx_frame_lost(slip_link *link);
+
+// Puts the loopback header in front of the IP packet at *ip, ready to write
+// to the utun. Returns the length including the header.
+int add_loopback_header(unsigned char **ip, int length);
+
+// Checks the loopback header on a frame read from the utun. Returns the
+// length of the IP packet after it, or -1 if the packet shouldn't be sent.
+int remove_loopback_header(slip_link *link, unsigned char *frame,
+                           int length);
+
+// Forwards packets for link from a single thread using kqueue, reconnecting
+// the device as needed. Only returns if the utun fails.
+void run_kqueue_engine(slip_link *link);
+
+#endif
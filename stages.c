@@ -0,0 +1,84 @@
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "compress.h"
+#include "crc.h"
+#include "slip.h"
+#include "vj.h"
+
+int tx_stages(slip_link *link, unsigned char **ip, int length) {
+    if (link->cslip) {
+        if (atomic_exchange_explicit(&link->vj_tx_reset, 0,
+                                     memory_order_relaxed)) {
+            vj_reset_tx(link->vj);
+        }
+        length = vj_compress(link->vj, ip, length);
+    }
+    if (link->compressor) {
+        length = compress_frame(link->compressor, ip, length);
+    }
+    return length;
+}
+
+int rx_stages(slip_link *link, unsigned char **ip, int length) {
+    if (link->compressor) {
+        length = decompress_frame(link->compressor, ip, length);
+        if (length == -1 && link->cslip) {
+            // VJ can't tell a packet went missing, make it resync
+            vj_reset_rx(link->vj);
+        }
+    }
+    if (link->cslip && length > 0) {
+        length = vj_uncompress(link->vj, ip, length);
+    }
+    return length;
+}
+
+int add_frame_check(slip_link *link, unsigned char *frame, int length) {
+    return frame_check_append(link->frame_check, frame, length);
+}
+
+int remove_frame_check(slip_link *link, unsigned char *frame, int length) {
+    return frame_check_verify(link->frame_check, frame, length);
+}
+
+void rx_frame_lost(slip_link *link) {
+    if (link->cslip) {
+        // VJ can't tell a packet went missing, make it resync
+        vj_reset_rx(link->vj);
+    }
+}
+
+int add_loopback_header(unsigned char **ip, int length) {
+    // The utun wants to know the protocol, which is all SLIP doesn't carry.
+    // The IP version is the top nibble of the first byte for both.
+    unsigned char *header = *ip - NULL_LOOPBACK_HEADER_SIZE;
+    header[0] = 0;
+    header[1] = 0;
+    header[2] = 0;
+    header[3] = ((*ip)[0] >> 4) == 6 ? AF_INET6 : AF_INET;
+    *ip = header;
+    return length + NULL_LOOPBACK_HEADER_SIZE;
+}
+
+int remove_loopback_header(slip_link *link, unsigned char *frame,
+                           int length) {
+    if (length <= NULL_LOOPBACK_HEADER_SIZE) {
+        STAT_ADD(link->stats.tx_protocol_dropped, 1);
+        return -1;
+    }
+
+    // The header is the address family in network byte order
+    uint32_t af = (uint32_t)frame[0] << 24 | (uint32_t)frame[1] << 16 |
+                  (uint32_t)frame[2] << 8 | frame[3];
+    if (af == AF_INET6 && !link->ipv6) {
+        // Mostly the Mac's own multicast listener and neighbour discovery
+        // traffic, which the remote can't use without IPv6 configured
+        STAT_ADD(link->stats.tx_protocol_dropped, 1);
+        return -1;
+    } else if (af != AF_INET && af != AF_INET6) {
+        STAT_ADD(link->stats.tx_protocol_dropped, 1);
+        return -1;
+    }
+    return length - NULL_LOOPBACK_HEADER_SIZE;
+}
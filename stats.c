@@ -0,0 +1,179 @@
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/event.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bond.h"
+#include "filter.h"
+#include "pool.h"
+#include "queue.h"
+#include "scheduler.h"
+#include "slip.h"
+#include "timing.h"
+
+typedef struct stats_server {
+    slip_link *links;
+    int count;
+    int listenfd; // or -1 for SIGUSR1 only
+} stats_server;
+
+#define LOAD(counter) atomic_load_explicit(&(counter), memory_order_relaxed)
+
+void write_stats(slip_link *link, FILE *out) {
+    link_stats *stats = &link->stats;
+
+    // Queues and the pool only exist with the threads engine
+    unsigned long tx_queued = 0, tx_queue_dropped = 0;
+    unsigned long rx_queued = 0, rx_queue_dropped = 0;
+    unsigned long pool_exhausted = 0;
+    if (link->tx_queue) {
+        for (int i = 0; i < link->tx_queue->classes; i++) {
+            tx_queued += packet_queue_length(&link->tx_queue->queues[i]);
+        }
+        tx_queue_dropped = tx_scheduler_dropped(link->tx_queue);
+        if (link->bond && link == link->bond->link) {
+            // The members' queues all being full counts too
+            tx_queue_dropped += LOAD(link->bond->queue_dropped);
+        }
+    }
+    if (link->rx_queue) {
+        rx_queued = packet_queue_length(link->rx_queue);
+        rx_queue_dropped = LOAD(link->rx_queue->dropped);
+    }
+    if (link->pool) {
+        pool_exhausted = LOAD(link->pool->exhausted);
+    }
+
+    fprintf(out, "{\"interface\": \"utun%i\", ", link->utun_num);
+    if (link->bond && link != link->bond->link) {
+        fprintf(out, "\"member\": \"%s\", ", link->device_path);
+    }
+    fprintf(out,
+            "\"tx\": {\"packets\": %lu, \"bytes\": %lu, \"frame_bytes\": %lu, "
+            "\"wire_bytes\": %lu, \"filtered\": %lu, "
+            "\"protocol_dropped\": %lu, \"stage_dropped\": %lu, "
+            "\"queue_dropped\": %lu, \"queued\": %lu, \"short_writes\": %lu, "
+            "\"write_errors\": %lu, \"outage_dropped\": %lu}, ",
+            LOAD(stats->tx_packets), LOAD(stats->tx_bytes),
+            LOAD(stats->tx_frame_bytes), LOAD(stats->tx_wire_bytes),
+            link->filter ? LOAD(link->filter->dropped) : 0,
+            LOAD(stats->tx_protocol_dropped),
+            LOAD(stats->tx_stage_dropped), tx_queue_dropped, tx_queued,
+            LOAD(stats->tx_short_writes), LOAD(stats->tx_write_errors),
+            LOAD(stats->tx_outage_dropped));
+    fprintf(out,
+            "\"rx\": {\"packets\": %lu, \"bytes\": %lu, \"frame_bytes\": %lu, "
+            "\"wire_bytes\": %lu, \"decode_errors\": %lu, "
+            "\"crc_errors\": %lu, \"too_long\": %lu, \"stage_dropped\": %lu, "
+            "\"queue_dropped\": %lu, \"queued\": %lu, \"write_errors\": %lu}, ",
+            LOAD(stats->rx_packets), LOAD(stats->rx_bytes),
+            LOAD(stats->rx_frame_bytes), LOAD(stats->rx_wire_bytes),
+            LOAD(stats->rx_decode_errors), LOAD(stats->rx_crc_errors),
+            LOAD(stats->rx_too_long),
+            LOAD(stats->rx_stage_dropped), rx_queue_dropped, rx_queued,
+            LOAD(stats->rx_write_errors));
+    fprintf(out, "\"pool_exhausted\": %lu, \"reconnects\": %lu, \"up\": %s",
+            pool_exhausted, LOAD(stats->reconnects),
+            atomic_load(&link->device_up) ? "true" : "false");
+    if (link->bond && link == link->bond->link) {
+        fprintf(out, ", \"bond\": {\"late\": %lu, \"lost\": %lu, "
+                     "\"resyncs\": %lu}",
+                LOAD(link->bond->late), LOAD(link->bond->lost),
+                LOAD(link->bond->resyncs));
+    }
+    if (link->timing) {
+        fprintf(out, ", \"latency\": ");
+        write_latency(link->timing, out);
+    }
+    fprintf(out, "}\n");
+}
+
+static void write_all_stats(stats_server *server, FILE *out) {
+    for (int i = 0; i < server->count; i++) {
+        slip_link *link = &server->links[i];
+        write_stats(link, out);
+        // Then a line for each device of a bond
+        for (int j = 0; link->bond && j < link->bond->count; j++) {
+            write_stats(&link->bond->members[j], out);
+        }
+    }
+    fflush(out);
+}
+
+static void *stats_thread(void *vargp) {
+    stats_server *server = (stats_server *)vargp;
+
+    int kq = kqueue();
+    if (kq == -1) {
+        perror("kqueue");
+        exit(1);
+    }
+
+    struct kevent changes[2];
+    int count = 0;
+    EV_SET(&changes[count++], SIGUSR1, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+    if (server->listenfd != -1) {
+        EV_SET(&changes[count++], server->listenfd, EVFILT_READ, EV_ADD, 0, 0,
+               NULL);
+    }
+    if (kevent(kq, changes, count, NULL, 0, NULL) == -1) {
+        perror("kevent");
+        exit(1);
+    }
+
+    while (1) {
+        struct kevent event;
+        if (kevent(kq, NULL, 0, &event, 1, NULL) != 1) {
+            continue;
+        }
+
+        if (event.filter == EVFILT_SIGNAL) {
+            write_all_stats(server, stdout);
+            continue;
+        }
+
+        // One dump per connection, then hang up
+        int fd = accept(server->listenfd, NULL, NULL);
+        if (fd == -1) {
+            continue;
+        }
+        FILE *out = fdopen(fd, "w");
+        if (out == NULL) {
+            close(fd);
+            continue;
+        }
+        write_all_stats(server, out);
+        fclose(out);
+    }
+    return vargp;
+}
+
+void start_stats(slip_link *links, int count, const char *socket_path) {
+    stats_server *server = malloc(sizeof(stats_server));
+    if (server == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    server->links = links;
+    server->count = count;
+    server->listenfd = -1;
+    if (socket_path) {
+        server->listenfd =
+            open_unix_domain_socket_as_server(socket_path, SOCK_STREAM);
+        // Owner only, whatever the umask, as we are running as root
+        if (chmod(socket_path, 0600) == -1) {
+            perror("chmod stats socket");
+            exit(1);
+        }
+    }
+
+    // Ignored so the kqueue can pick it up instead of it killing us
+    signal(SIGUSR1, SIG_IGN);
+
+    pthread_t thread_id;
+    pthread_create(&thread_id, NULL, stats_thread, server);
+}
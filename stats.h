@@ -0,0 +1,38 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdatomic.h>
+
+// Counters for one link, updated on the hot paths with relaxed atomic adds
+// and read by whoever asks for a dump. TX is utun -> device, RX is device ->
+// utun. bytes are IP bytes, frame_bytes what is left after the stages
+// (compression) and wire_bytes after SLIP encoding, so wire_bytes over
+// frame_bytes is the escaping overhead.
+typedef struct link_stats {
+    atomic_ulong tx_packets;
+    atomic_ulong tx_bytes;
+    atomic_ulong tx_frame_bytes;
+    atomic_ulong tx_wire_bytes;
+    atomic_ulong tx_stage_dropped;
+    atomic_ulong tx_protocol_dropped; // IPv6 without -6, or not IP at all
+    atomic_ulong tx_short_writes;
+    atomic_ulong tx_write_errors;
+    atomic_ulong tx_outage_dropped; // while the device was being reconnected
+
+    atomic_ulong rx_packets;
+    atomic_ulong rx_bytes;
+    atomic_ulong rx_frame_bytes;
+    atomic_ulong rx_wire_bytes; // not counted by the byte decoder
+    atomic_ulong rx_decode_errors; // bad escapes, the frame is skipped
+    atomic_ulong rx_crc_errors;    // failed the -k frame check
+    atomic_ulong rx_too_long;
+    atomic_ulong rx_stage_dropped;
+    atomic_ulong rx_write_errors;
+
+    atomic_ulong reconnects;
+} link_stats;
+
+#define STAT_ADD(counter, n)                                                   \
+    atomic_fetch_add_explicit(&(counter), (n), memory_order_relaxed)
+
+#endif
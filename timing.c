@@ -0,0 +1,139 @@
+#include "timing.h"
+
+#include <os/signpost.h>
+#include <stdlib.h>
+
+static mach_timebase_info_data_t timebase;
+static os_log_t signpost_log;
+
+link_timing *timing_create(void) {
+    mach_timebase_info(&timebase);
+    signpost_log = os_log_create("slip", "packets");
+
+    link_timing *timing = calloc(1, sizeof(link_timing));
+    if (timing == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    return timing;
+}
+
+static int bucket_index(uint64_t us) {
+    if (us < HISTOGRAM_SUB_BUCKETS) {
+        return us;
+    } else if (us > UINT32_MAX) {
+        us = UINT32_MAX;
+    }
+    int exponent = 63 - __builtin_clzll(us);
+    int sub = (us >> (exponent - 3)) & (HISTOGRAM_SUB_BUCKETS - 1);
+    return (exponent - 2) * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+static uint64_t bucket_start(int index) {
+    if (index < HISTOGRAM_SUB_BUCKETS) {
+        return index;
+    }
+    int exponent = index / HISTOGRAM_SUB_BUCKETS + 2;
+    uint64_t sub = index % HISTOGRAM_SUB_BUCKETS;
+    return (HISTOGRAM_SUB_BUCKETS + sub) << (exponent - 3);
+}
+
+void histogram_record(latency_histogram *histogram, uint64_t start,
+                      uint64_t end) {
+    uint64_t us =
+        end > start ? (end - start) * timebase.numer / timebase.denom / 1000
+                    : 0;
+
+    atomic_fetch_add_explicit(&histogram->buckets[bucket_index(us)], 1,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+
+    // Only one thread records into each histogram, so this can't race
+    // another update
+    if (us > atomic_load_explicit(&histogram->max_us, memory_order_relaxed)) {
+        atomic_store_explicit(&histogram->max_us, us, memory_order_relaxed);
+    }
+}
+
+static void write_histogram(const char *name, latency_histogram *histogram,
+                            FILE *out) {
+    static const double percentiles[] = {50, 90, 99, 99.9};
+    static const char *labels[] = {"p50", "p90", "p99", "p999"};
+
+    unsigned long count =
+        atomic_load_explicit(&histogram->count, memory_order_relaxed);
+    unsigned long max =
+        atomic_load_explicit(&histogram->max_us, memory_order_relaxed);
+    fprintf(out, "\"%s\": {\"count\": %lu", name, count);
+
+    // Each percentile is reported as the top of the bucket it falls in
+    unsigned long seen = 0;
+    int bucket = 0;
+    for (int i = 0; i < 4; i++) {
+        unsigned long target = (unsigned long)(count * percentiles[i] / 100);
+        while (bucket < HISTOGRAM_BUCKETS - 1 &&
+               seen + atomic_load_explicit(&histogram->buckets[bucket],
+                                           memory_order_relaxed) <=
+                   target) {
+            seen += atomic_load_explicit(&histogram->buckets[bucket],
+                                         memory_order_relaxed);
+            bucket++;
+        }
+        uint64_t value = count ? bucket_start(bucket + 1) - 1 : 0;
+        if (value > max) {
+            value = max;
+        }
+        fprintf(out, ", \"%s_us\": %llu", labels[i],
+                (unsigned long long)value);
+    }
+
+    fprintf(out, ", \"max_us\": %lu}", max);
+}
+
+void write_latency(link_timing *timing, FILE *out) {
+    fprintf(out, "{");
+    write_histogram("tx_queue", &timing->tx_queue, out);
+    fprintf(out, ", ");
+    write_histogram("tx_encode", &timing->tx_encode, out);
+    fprintf(out, ", ");
+    write_histogram("tx_write", &timing->tx_write, out);
+    fprintf(out, ", ");
+    write_histogram("tx_total", &timing->tx_total, out);
+    fprintf(out, ", ");
+    write_histogram("tx_wakeup", &timing->tx_wakeup, out);
+    fprintf(out, ", ");
+    write_histogram("rx_wire", &timing->rx_wire, out);
+    fprintf(out, ", ");
+    write_histogram("rx_queue", &timing->rx_queue, out);
+    fprintf(out, ", ");
+    write_histogram("rx_write", &timing->rx_write, out);
+    fprintf(out, ", ");
+    write_histogram("rx_total", &timing->rx_total, out);
+    fprintf(out, ", ");
+    write_histogram("rx_wakeup", &timing->rx_wakeup, out);
+    fprintf(out, "}");
+}
+
+void signpost_tx_begin(const void *packet) {
+    os_signpost_interval_begin(
+        signpost_log, os_signpost_id_make_with_pointer(signpost_log, packet),
+        "TX");
+}
+
+void signpost_tx_end(const void *packet) {
+    os_signpost_interval_end(
+        signpost_log, os_signpost_id_make_with_pointer(signpost_log, packet),
+        "TX");
+}
+
+void signpost_rx_begin(const void *packet) {
+    os_signpost_interval_begin(
+        signpost_log, os_signpost_id_make_with_pointer(signpost_log, packet),
+        "RX");
+}
+
+void signpost_rx_end(const void *packet) {
+    os_signpost_interval_end(
+        signpost_log, os_signpost_id_make_with_pointer(signpost_log, packet),
+        "RX");
+}
@@ -0,0 +1,65 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <mach/mach_time.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Optional latency measurement (-T). Packets are timestamped with
+// mach_absolute_time() at each stage boundary and the gaps recorded in
+// log-linear histograms, which are reported with the other statistics.
+// Each packet is also an os_signpost interval, so Instruments can show where
+// time goes. Off, none of this is ever called.
+
+// Histograms are in microseconds. Values below 8 get a bucket each, above
+// that every power of two is split into 8 linear buckets, so anything up to
+// 2^32 us is within 12.5%.
+#define HISTOGRAM_SUB_BUCKETS 8
+#define HISTOGRAM_BUCKETS ((32 - 2) * HISTOGRAM_SUB_BUCKETS)
+
+typedef struct latency_histogram {
+    atomic_ulong buckets[HISTOGRAM_BUCKETS];
+    atomic_ulong count;
+    atomic_ulong max_us;
+} latency_histogram;
+
+typedef struct link_timing {
+    // utun read -> taken from the queue -> stages and encoding done ->
+    // device write returned. For batches total is from the oldest packet.
+    latency_histogram tx_queue;
+    latency_histogram tx_encode;
+    latency_histogram tx_write;
+    latency_histogram tx_total;
+    // queued -> the writer running, when it had been asleep waiting for
+    // the packet. This is the scheduling latency -y is meant to cut.
+    latency_histogram tx_wakeup;
+
+    // first byte of the frame read -> frame decoded -> taken from the queue
+    // -> utun write returned
+    latency_histogram rx_wire;
+    latency_histogram rx_queue;
+    latency_histogram rx_write;
+    latency_histogram rx_total;
+    latency_histogram rx_wakeup;
+} link_timing;
+
+link_timing *timing_create(void);
+
+static inline uint64_t timing_now(void) { return mach_absolute_time(); }
+
+// start and end are timing_now() values
+void histogram_record(latency_histogram *histogram, uint64_t start,
+                      uint64_t end);
+
+// Writes percentiles for every histogram as a JSON object
+void write_latency(link_timing *timing, FILE *out);
+
+// Per-packet signpost intervals. packet identifies the interval so it has to
+// be the same, and unique among packets in flight, at both ends.
+void signpost_tx_begin(const void *packet);
+void signpost_tx_end(const void *packet);
+void signpost_rx_begin(const void *packet);
+void signpost_rx_end(const void *packet);
+
+#endif
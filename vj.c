@@ -0,0 +1,437 @@
+#include "vj.h"
+
+#include <netinet/in.h>
+#include <string.h>
+
+// Offsets of the fields we need in the IPv4 and TCP headers. Packets are
+// only byte aligned in our buffers so fields are accessed a byte at a time.
+#define IPH_VHL 0
+#define IPH_LEN 2
+#define IPH_ID 4
+#define IPH_OFF 6
+#define IPH_TTL 8
+#define IPH_PROTO 9
+#define IPH_SUM 10
+#define IPH_SRC 12 // followed by the destination
+
+#define TCPH_SEQ 4
+#define TCPH_ACK 8
+#define TCPH_OFF 12
+#define TCPH_FLAGS 13
+#define TCPH_WIN 14
+#define TCPH_SUM 16
+#define TCPH_URP 18
+
+#define TH_FIN 0x01
+#define TH_SYN 0x02
+#define TH_RST 0x04
+#define TH_PUSH 0x08
+#define TH_ACK 0x10
+#define TH_URG 0x20
+
+// Bits in the change mask, the first byte of a compressed packet
+#define NEW_C 0x40
+#define NEW_I 0x20
+#define TCP_PUSH_BIT 0x10
+#define NEW_S 0x08
+#define NEW_A 0x04
+#define NEW_W 0x02
+#define NEW_U 0x01
+
+// Combinations that can't happen normally, used for common special cases
+#define SPECIAL_I (NEW_S | NEW_W | NEW_U) // echoed interactive traffic
+#define SPECIAL_D (NEW_S | NEW_A | NEW_W | NEW_U) // unidirectional data
+#define SPECIALS_MASK (NEW_S | NEW_A | NEW_W | NEW_U)
+
+#define NO_CONNECTION 255
+
+static uint16_t get16(const unsigned char *p) { return (p[0] << 8) | p[1]; }
+
+static uint32_t get32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void put16(unsigned char *p, uint16_t value) {
+    p[0] = value >> 8;
+    p[1] = value;
+}
+
+static void put32(unsigned char *p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+// Deltas under 256 take one byte, anything else (including 0) is a zero
+// byte followed by 16 bits.
+static unsigned char *encode_delta(unsigned char *cp, uint16_t n) {
+    if (n >= 256 || n == 0) {
+        *cp++ = 0;
+        *cp++ = n >> 8;
+        *cp++ = n;
+    } else {
+        *cp++ = n;
+    }
+    return cp;
+}
+
+static const unsigned char *decode_delta(const unsigned char *cp,
+                                         uint16_t *n) {
+    if (*cp == 0) {
+        *n = (cp[1] << 8) | cp[2];
+        return cp + 3;
+    }
+    *n = *cp;
+    return cp + 1;
+}
+
+static uint16_t ip_checksum(const unsigned char *ip, int length) {
+    uint32_t sum = 0;
+    for (int i = 0; i < length; i += 2) {
+        sum += get16(&ip[i]);
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return ~sum;
+}
+
+static int header_length(const unsigned char *ip, int length) {
+    // Length of the IP and TCP headers together, or 0 if they aren't both
+    // there
+    int ip_hlen = (ip[IPH_VHL] & 0x0f) * 4;
+    if (ip_hlen < 20 || ip_hlen + 20 > length) {
+        return 0;
+    }
+    int tcp_hlen = (ip[ip_hlen + TCPH_OFF] >> 4) * 4;
+    if (tcp_hlen < 20 || ip_hlen + tcp_hlen > length) {
+        return 0;
+    }
+    return ip_hlen + tcp_hlen;
+}
+
+void vj_init(vj_compressor *vj) {
+    memset(vj, 0, sizeof(*vj));
+    for (int i = 0; i < VJ_MAX_STATES; i++) {
+        vj->tx[i].id = i;
+        vj->rx[i].id = i;
+    }
+    vj->last_sent = NO_CONNECTION;
+    vj_reset_rx(vj);
+}
+
+void vj_reset_tx(vj_compressor *vj) {
+    for (int i = 0; i < VJ_MAX_STATES; i++) {
+        vj->tx[i].length = 0;
+    }
+    vj->last_sent = NO_CONNECTION;
+}
+
+void vj_reset_rx(vj_compressor *vj) {
+    for (int i = 0; i < VJ_MAX_STATES; i++) {
+        vj->rx[i].length = 0;
+    }
+    vj->last_received = NO_CONNECTION;
+    vj->toss = 1;
+}
+
+int vj_compress(vj_compressor *vj, unsigned char **packet, int length) {
+    unsigned char *ip = *packet;
+
+    // Only plain TCP ACKs (no SYN/FIN/RST) of unfragmented IPv4 packets are
+    // compressed, everything else goes as TYPE_IP
+    if (length < 40 || (ip[IPH_VHL] >> 4) != 4 ||
+        ip[IPH_PROTO] != IPPROTO_TCP || (get16(&ip[IPH_OFF]) & 0x3fff)) {
+        return length;
+    }
+    int hlen = header_length(ip, length);
+    if (hlen == 0) {
+        return length;
+    }
+    int ip_hlen = (ip[IPH_VHL] & 0x0f) * 4;
+    unsigned char *th = &ip[ip_hlen];
+    if ((th[TCPH_FLAGS] & (TH_SYN | TH_FIN | TH_RST | TH_ACK)) != TH_ACK) {
+        return length;
+    }
+
+    // Find the connection by addresses and ports, or reuse the slot that
+    // has gone longest without a packet
+    vj_state *cs = NULL;
+    vj_state *oldest = &vj->tx[0];
+    for (int i = 0; i < VJ_MAX_STATES; i++) {
+        vj_state *s = &vj->tx[i];
+        if (s->length &&
+            memcmp(&s->header[IPH_SRC], &ip[IPH_SRC], 8) == 0 &&
+            memcmp(&s->header[(s->header[IPH_VHL] & 0x0f) * 4], th, 4) == 0) {
+            cs = s;
+            break;
+        }
+        if (s->last_used < oldest->last_used) {
+            oldest = s;
+        }
+    }
+
+    vj->clock++;
+    if (cs == NULL) {
+        cs = oldest;
+        cs->last_used = vj->clock;
+        goto uncompressed;
+    }
+    cs->last_used = vj->clock;
+
+    unsigned char *oip = cs->header;
+    unsigned char *oth = &oip[ip_hlen];
+
+    // Make sure only what we expect to change has changed (options
+    // included), otherwise send the full header
+    if (get16(&ip[IPH_VHL]) != get16(&oip[IPH_VHL]) ||
+        get16(&ip[IPH_OFF]) != get16(&oip[IPH_OFF]) ||
+        get16(&ip[IPH_TTL]) != get16(&oip[IPH_TTL]) ||
+        (th[TCPH_OFF] >> 4) != (oth[TCPH_OFF] >> 4) ||
+        memcmp(&ip[20], &oip[20], ip_hlen - 20) != 0 ||
+        memcmp(&th[20], &oth[20], hlen - ip_hlen - 20) != 0) {
+        goto uncompressed;
+    }
+
+    unsigned char deltas[16];
+    unsigned char *cp = deltas;
+    int changes = 0;
+
+    if (th[TCPH_FLAGS] & TH_URG) {
+        cp = encode_delta(cp, get16(&th[TCPH_URP]));
+        changes |= NEW_U;
+    } else if (get16(&th[TCPH_URP]) != get16(&oth[TCPH_URP]) ||
+               (oth[TCPH_FLAGS] & TH_URG)) {
+        // The special cases leave URG as it was, so it can only be cleared
+        // with a full header
+        goto uncompressed;
+    }
+
+    uint16_t delta_win = get16(&th[TCPH_WIN]) - get16(&oth[TCPH_WIN]);
+    if (delta_win) {
+        cp = encode_delta(cp, delta_win);
+        changes |= NEW_W;
+    }
+
+    uint32_t delta_ack = get32(&th[TCPH_ACK]) - get32(&oth[TCPH_ACK]);
+    if (delta_ack) {
+        if (delta_ack > 0xffff) {
+            goto uncompressed;
+        }
+        cp = encode_delta(cp, delta_ack);
+        changes |= NEW_A;
+    }
+
+    uint32_t delta_seq = get32(&th[TCPH_SEQ]) - get32(&oth[TCPH_SEQ]);
+    if (delta_seq) {
+        if (delta_seq > 0xffff) {
+            goto uncompressed;
+        }
+        cp = encode_delta(cp, delta_seq);
+        changes |= NEW_S;
+    }
+
+    // Bytes of data in the previous packet on this connection
+    uint32_t last_data = get16(&oip[IPH_LEN]) - hlen;
+
+    switch (changes) {
+    case 0:
+        // Nothing changed. If this packet has data and the last one didn't,
+        // it's probably data following an ACK on an interactive connection,
+        // so compress it. Otherwise it's probably a retransmit, so send the
+        // whole header in case the other end missed the compressed one.
+        if (get16(&ip[IPH_LEN]) != get16(&oip[IPH_LEN]) && last_data == 0) {
+            break;
+        }
+        goto uncompressed;
+
+    case SPECIAL_I:
+    case SPECIAL_D:
+        // Would be mistaken for the special cases
+        goto uncompressed;
+
+    case NEW_S | NEW_A:
+        if (delta_seq == delta_ack && delta_seq == last_data) {
+            changes = SPECIAL_I;
+            cp = deltas;
+        }
+        break;
+
+    case NEW_S:
+        if (delta_seq == last_data) {
+            changes = SPECIAL_D;
+            cp = deltas;
+        }
+        break;
+    }
+
+    uint16_t delta_id = get16(&ip[IPH_ID]) - get16(&oip[IPH_ID]);
+    if (delta_id != 1) {
+        cp = encode_delta(cp, delta_id);
+        changes |= NEW_I;
+    }
+    if (th[TCPH_FLAGS] & TH_PUSH) {
+        changes |= TCP_PUSH_BIT;
+    }
+
+    uint16_t checksum = get16(&th[TCPH_SUM]);
+    memcpy(cs->header, ip, hlen);
+    cs->length = hlen;
+
+    // The compressed header goes immediately before the TCP data. The
+    // connection id can be left out if it's the same as last time.
+    int delta_length = cp - deltas;
+    int send_id = vj->last_sent != cs->id;
+    int compressed_length = 1 + send_id + 2 + delta_length;
+    unsigned char *out = &ip[hlen - compressed_length];
+
+    *out++ = TYPE_COMPRESSED_TCP | changes | (send_id ? NEW_C : 0);
+    if (send_id) {
+        *out++ = cs->id;
+        vj->last_sent = cs->id;
+    }
+    put16(out, checksum);
+    memcpy(out + 2, deltas, delta_length);
+
+    *packet = &ip[hlen - compressed_length];
+    return length - hlen + compressed_length;
+
+uncompressed:
+    // Send the whole header so the other end can (re)build its state. The
+    // protocol field carries the connection id instead.
+    memcpy(cs->header, ip, hlen);
+    cs->length = hlen;
+    ip[IPH_PROTO] = cs->id;
+    ip[IPH_VHL] = (ip[IPH_VHL] & 0x0f) | TYPE_UNCOMPRESSED_TCP;
+    vj->last_sent = cs->id;
+    return length;
+}
+
+int vj_uncompress(vj_compressor *vj, unsigned char **packet, int length) {
+    unsigned char *buf = *packet;
+    if (length < 1) {
+        return -1;
+    }
+
+    int type = buf[0] & 0xf0;
+    if (type == TYPE_IP || type == 0x60) {
+        // Plain IPv4, or IPv6 which VJ doesn't touch
+        return length;
+    } else if (type == TYPE_UNCOMPRESSED_TCP) {
+        buf[IPH_VHL] = (buf[IPH_VHL] & 0x0f) | TYPE_IP;
+        int hlen = length >= 40 ? header_length(buf, length) : 0;
+        if (hlen == 0 || buf[IPH_PROTO] >= VJ_MAX_STATES) {
+            goto bad;
+        }
+
+        vj_state *cs = &vj->rx[buf[IPH_PROTO]];
+        vj->last_received = buf[IPH_PROTO];
+        vj->toss = 0;
+
+        buf[IPH_PROTO] = IPPROTO_TCP;
+        memcpy(cs->header, buf, hlen);
+        cs->length = hlen;
+        return length;
+    } else if (!(type & TYPE_COMPRESSED_TCP)) {
+        // TYPE_ERROR, or garbage
+        goto bad;
+    }
+
+    // Compressed headers are at most 19 bytes. Our buffers always have at
+    // least that much after the packet so the bounds are checked once the
+    // whole header has been read.
+    const unsigned char *cp = buf;
+    int changes = *cp++;
+    if (changes & NEW_C) {
+        if (*cp >= VJ_MAX_STATES) {
+            goto bad;
+        }
+        vj->toss = 0;
+        vj->last_received = *cp++;
+    } else if (vj->toss) {
+        // Lost track of the connection, wait for its id to be sent
+        return -1;
+    }
+
+    if (vj->last_received >= VJ_MAX_STATES ||
+        vj->rx[vj->last_received].length == 0) {
+        goto bad;
+    }
+    vj_state *cs = &vj->rx[vj->last_received];
+    unsigned char *ip = cs->header;
+    unsigned char *th = &ip[(ip[IPH_VHL] & 0x0f) * 4];
+    uint16_t delta;
+
+    put16(&th[TCPH_SUM], (cp[0] << 8) | cp[1]);
+    cp += 2;
+
+    if (changes & TCP_PUSH_BIT) {
+        th[TCPH_FLAGS] |= TH_PUSH;
+    } else {
+        th[TCPH_FLAGS] &= ~TH_PUSH;
+    }
+
+    uint32_t last_data = get16(&ip[IPH_LEN]) - cs->length;
+
+    switch (changes & SPECIALS_MASK) {
+    case SPECIAL_I:
+        put32(&th[TCPH_ACK], get32(&th[TCPH_ACK]) + last_data);
+        put32(&th[TCPH_SEQ], get32(&th[TCPH_SEQ]) + last_data);
+        break;
+
+    case SPECIAL_D:
+        put32(&th[TCPH_SEQ], get32(&th[TCPH_SEQ]) + last_data);
+        break;
+
+    default:
+        if (changes & NEW_U) {
+            th[TCPH_FLAGS] |= TH_URG;
+            cp = decode_delta(cp, &delta);
+            put16(&th[TCPH_URP], delta);
+        } else {
+            th[TCPH_FLAGS] &= ~TH_URG;
+        }
+        if (changes & NEW_W) {
+            cp = decode_delta(cp, &delta);
+            put16(&th[TCPH_WIN], get16(&th[TCPH_WIN]) + delta);
+        }
+        if (changes & NEW_A) {
+            cp = decode_delta(cp, &delta);
+            put32(&th[TCPH_ACK], get32(&th[TCPH_ACK]) + delta);
+        }
+        if (changes & NEW_S) {
+            cp = decode_delta(cp, &delta);
+            put32(&th[TCPH_SEQ], get32(&th[TCPH_SEQ]) + delta);
+        }
+        break;
+    }
+
+    if (changes & NEW_I) {
+        cp = decode_delta(cp, &delta);
+        put16(&ip[IPH_ID], get16(&ip[IPH_ID]) + delta);
+    } else {
+        put16(&ip[IPH_ID], get16(&ip[IPH_ID]) + 1);
+    }
+
+    int compressed_length = cp - buf;
+    if (compressed_length > length) {
+        goto bad;
+    }
+
+    // Rebuild the header in front of the data
+    int data_length = length - compressed_length;
+    int ip_hlen = (ip[IPH_VHL] & 0x0f) * 4;
+    put16(&ip[IPH_LEN], data_length + cs->length);
+    put16(&ip[IPH_SUM], 0);
+    put16(&ip[IPH_SUM], ip_checksum(ip, ip_hlen));
+
+    unsigned char *out = &buf[compressed_length - cs->length];
+    memcpy(out, cs->header, cs->length);
+    *packet = out;
+    return data_length + cs->length;
+
+bad:
+    vj->toss = 1;
+    return -1;
+}
@@ -0,0 +1,62 @@
+#ifndef VJ_H
+#define VJ_H
+
+#include <stdint.h>
+
+// Van Jacobson TCP/IP header compression (RFC 1144), as used by CSLIP.
+//
+// The packet type travels in the top bits of the first byte of each frame,
+// where the IP version normally is, so plain IP packets are still sent as
+// they are.
+
+#define TYPE_IP 0x40
+#define TYPE_UNCOMPRESSED_TCP 0x70
+#define TYPE_COMPRESSED_TCP 0x80
+#define TYPE_ERROR 0x00
+
+#define VJ_MAX_STATES 16
+// Largest TCP/IP header we keep state for (60 bytes each of IP and TCP),
+// and so the most room decompression can need in front of a packet.
+#define VJ_MAX_HEADER 128
+
+typedef struct vj_state {
+    unsigned char header[VJ_MAX_HEADER]; // last header sent on connection
+    int length;                          // of header
+    uint8_t id;
+    unsigned long last_used; // compressor only, to pick a slot to reuse
+} vj_state;
+
+typedef struct vj_compressor {
+    vj_state tx[VJ_MAX_STATES];
+    vj_state rx[VJ_MAX_STATES];
+    unsigned long clock;
+    uint8_t last_sent;     // connection id of the last compressed packet
+    uint8_t last_received; // ... and the last one received
+    int toss;              // drop compressed packets until one sets the id
+} vj_compressor;
+
+void vj_init(vj_compressor *vj);
+
+// Forget everything received so far, e.g. because the remote end was
+// reconnected. Compressed packets are dropped until the remote sends the
+// full header again.
+void vj_reset_rx(vj_compressor *vj);
+
+// Forget everything sent so far, so the next packet on every connection goes
+// with its full header. A remote that has just restarted can't decompress
+// anything else.
+void vj_reset_tx(vj_compressor *vj);
+
+// Compresses the IP packet at *packet (length bytes) in place. The
+// compressed header is written over the end of the original, so *packet
+// may move forward. Returns the new length; the packet type has already
+// been put in the first byte.
+int vj_compress(vj_compressor *vj, unsigned char **packet, int length);
+
+// Reverses vj_compress(). The rebuilt header is written in front of the
+// data, so there must be VJ_MAX_HEADER bytes of room before *packet, which
+// may move back. Returns the new length, or -1 if the packet should be
+// dropped.
+int vj_uncompress(vj_compressor *vj, unsigned char **packet, int length);
+
+#endif